@@ -0,0 +1,400 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define AES_BLOCK 16
+#define AES_ROUNDS 10
+
+enum { IMPL_SOFT, IMPL_AESNI, IMPL_VAES };
+static int impl = -1;
+
+static unsigned char sbox[256];
+static unsigned char inv_sbox[256];
+
+/* Multiplication by x in GF(2^8) */
+static unsigned char xtime( unsigned char a )
+{
+	return (a << 1) ^ ((a & 0x80) ? 0x1b : 0);
+}
+
+static unsigned char gmul( unsigned char a, unsigned char b )
+{
+	unsigned char p = 0;
+	while(b) {
+		if(b & 1) p ^= a;
+		a = xtime(a);
+		b >>= 1;
+	}
+	return p;
+}
+
+/* Builds the S-boxes from the field inverse and the affine transform */
+static void build_sbox()
+{
+	int i;
+	for(i = 0; i < 256; i++) {
+		unsigned char inv = 0, x, s;
+		int j;
+		if(i) {
+			for(j = 1; j < 256; j++) {
+				if(gmul(i, j) == 1) {
+					inv = j;
+					break;
+				}
+			}
+		}
+		x = inv;
+		s = x;
+		for(j = 0; j < 4; j++) {
+			x = (x << 1) | (x >> 7);
+			s ^= x;
+		}
+		s ^= 0x63;
+		sbox[i] = s;
+		inv_sbox[s] = i;
+	}
+}
+
+static void detect_impl()
+{
+	if(impl >= 0) return;
+	build_sbox();
+	impl = IMPL_SOFT;
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1")) {
+		impl = IMPL_AESNI;
+		if(__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f")) {
+			impl = IMPL_VAES;
+		}
+	}
+#endif
+	/* lets the fallback be exercised on AES capable machines */
+	if(getenv("DISK_AES_SOFT")) {
+		impl = IMPL_SOFT;
+	}
+}
+
+const char *xts_impl_name()
+{
+	detect_impl();
+	switch(impl) {
+	case IMPL_VAES: return "vaes";
+	case IMPL_AESNI: return "aes-ni";
+	default: return "software";
+	}
+}
+
+/* AES-128 key expansion */
+static void expand_key( unsigned char rk[11][16], const unsigned char *key )
+{
+	unsigned char rcon = 1;
+	int i, j;
+	memcpy(rk[0], key, AES_BLOCK);
+	for(i = 1; i <= AES_ROUNDS; i++) {
+		unsigned char *prev = rk[i - 1];
+		unsigned char t[4];
+		t[0] = sbox[prev[13]] ^ rcon;
+		t[1] = sbox[prev[14]];
+		t[2] = sbox[prev[15]];
+		t[3] = sbox[prev[12]];
+		rcon = xtime(rcon);
+		for(j = 0; j < 16; j++) {
+			rk[i][j] = prev[j] ^ (j < 4 ? t[j] : rk[i][j - 4]);
+		}
+	}
+}
+
+/* Software fallback */
+
+static void add_round_key( unsigned char *s, const unsigned char *k )
+{
+	int i;
+	for(i = 0; i < AES_BLOCK; i++) s[i] ^= k[i];
+}
+
+static void sub_shift_rows( unsigned char *s, const unsigned char *box, int inverse )
+{
+	unsigned char t[AES_BLOCK];
+	int c, r;
+	for(c = 0; c < 4; c++) {
+		for(r = 0; r < 4; r++) {
+			int from = inverse ? (c + 4 - r) % 4 : (c + r) % 4;
+			t[c * 4 + r] = box[s[from * 4 + r]];
+		}
+	}
+	memcpy(s, t, AES_BLOCK);
+}
+
+static void mix_columns( unsigned char *s )
+{
+	int c;
+	for(c = 0; c < 4; c++) {
+		unsigned char *col = s + c * 4;
+		unsigned char a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+		unsigned char all = a0 ^ a1 ^ a2 ^ a3;
+		col[0] ^= all ^ xtime(a0 ^ a1);
+		col[1] ^= all ^ xtime(a1 ^ a2);
+		col[2] ^= all ^ xtime(a2 ^ a3);
+		col[3] ^= all ^ xtime(a3 ^ a0);
+	}
+}
+
+/* InvMixColumns factored as a pre-multiplication followed by MixColumns */
+static void inv_mix_columns( unsigned char *s )
+{
+	int c;
+	for(c = 0; c < 4; c++) {
+		unsigned char *col = s + c * 4;
+		unsigned char u = xtime(xtime(col[0] ^ col[2]));
+		unsigned char v = xtime(xtime(col[1] ^ col[3]));
+		col[0] ^= u;
+		col[1] ^= v;
+		col[2] ^= u;
+		col[3] ^= v;
+	}
+	mix_columns(s);
+}
+
+static void soft_encrypt_block( const unsigned char rk[11][16], unsigned char *s )
+{
+	int r;
+	add_round_key(s, rk[0]);
+	for(r = 1; r < AES_ROUNDS; r++) {
+		sub_shift_rows(s, sbox, 0);
+		mix_columns(s);
+		add_round_key(s, rk[r]);
+	}
+	sub_shift_rows(s, sbox, 0);
+	add_round_key(s, rk[AES_ROUNDS]);
+}
+
+static void soft_decrypt_block( const unsigned char rk[11][16], unsigned char *s )
+{
+	int r;
+	add_round_key(s, rk[AES_ROUNDS]);
+	for(r = AES_ROUNDS - 1; r > 0; r--) {
+		sub_shift_rows(s, inv_sbox, 1);
+		add_round_key(s, rk[r]);
+		inv_mix_columns(s);
+	}
+	sub_shift_rows(s, inv_sbox, 1);
+	add_round_key(s, rk[0]);
+}
+
+static void soft_xts( const xts_key *key, unsigned char *data, const unsigned char *tweaks, int n, int decrypt )
+{
+	int i;
+	for(i = 0; i < n; i++) {
+		unsigned char *b = data + i * AES_BLOCK;
+		add_round_key(b, tweaks + i * AES_BLOCK);
+		if(decrypt) {
+			soft_decrypt_block(key->rk_enc, b);
+		} else {
+			soft_encrypt_block(key->rk_enc, b);
+		}
+		add_round_key(b, tweaks + i * AES_BLOCK);
+	}
+}
+
+#ifdef HAVE_X86
+
+/* AES-NI: eight independent blocks per iteration so the aesenc latency
+   of one block is hidden behind the others */
+__attribute__((target("aes,sse4.1")))
+static void aesni_xts( const xts_key *key, unsigned char *data, const unsigned char *tweaks, int n, int decrypt )
+{
+	const unsigned char (*rk)[16] = decrypt ? key->rk_dec : key->rk_enc;
+	__m128i k[AES_ROUNDS + 1];
+	int i, j, r;
+
+	for(r = 0; r <= AES_ROUNDS; r++) {
+		k[r] = _mm_loadu_si128((const __m128i *)rk[r]);
+	}
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		__m128i b[8], t[8];
+		for(j = 0; j < 8; j++) {
+			t[j] = _mm_loadu_si128((const __m128i *)(tweaks + (i + j) * AES_BLOCK));
+			b[j] = _mm_loadu_si128((const __m128i *)(data + (i + j) * AES_BLOCK));
+			b[j] = _mm_xor_si128(_mm_xor_si128(b[j], t[j]), k[0]);
+		}
+		if(decrypt) {
+			for(r = 1; r < AES_ROUNDS; r++) {
+				for(j = 0; j < 8; j++) b[j] = _mm_aesdec_si128(b[j], k[r]);
+			}
+			for(j = 0; j < 8; j++) b[j] = _mm_aesdeclast_si128(b[j], k[AES_ROUNDS]);
+		} else {
+			for(r = 1; r < AES_ROUNDS; r++) {
+				for(j = 0; j < 8; j++) b[j] = _mm_aesenc_si128(b[j], k[r]);
+			}
+			for(j = 0; j < 8; j++) b[j] = _mm_aesenclast_si128(b[j], k[AES_ROUNDS]);
+		}
+		for(j = 0; j < 8; j++) {
+			_mm_storeu_si128((__m128i *)(data + (i + j) * AES_BLOCK), _mm_xor_si128(b[j], t[j]));
+		}
+	}
+
+	for(; i < n; i++) {
+		__m128i t = _mm_loadu_si128((const __m128i *)(tweaks + i * AES_BLOCK));
+		__m128i b = _mm_loadu_si128((const __m128i *)(data + i * AES_BLOCK));
+		b = _mm_xor_si128(_mm_xor_si128(b, t), k[0]);
+		for(r = 1; r < AES_ROUNDS; r++) {
+			b = decrypt ? _mm_aesdec_si128(b, k[r]) : _mm_aesenc_si128(b, k[r]);
+		}
+		b = decrypt ? _mm_aesdeclast_si128(b, k[AES_ROUNDS]) : _mm_aesenclast_si128(b, k[AES_ROUNDS]);
+		_mm_storeu_si128((__m128i *)(data + i * AES_BLOCK), _mm_xor_si128(b, t));
+	}
+}
+
+__attribute__((target("aes,sse4.1")))
+static void aesni_encrypt_block( const unsigned char rk[11][16], unsigned char *s )
+{
+	__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)s), _mm_loadu_si128((const __m128i *)rk[0]));
+	int r;
+	for(r = 1; r < AES_ROUNDS; r++) {
+		b = _mm_aesenc_si128(b, _mm_loadu_si128((const __m128i *)rk[r]));
+	}
+	b = _mm_aesenclast_si128(b, _mm_loadu_si128((const __m128i *)rk[AES_ROUNDS]));
+	_mm_storeu_si128((__m128i *)s, b);
+}
+
+__attribute__((target("aes,sse4.1")))
+static void aesni_decrypt_schedule( xts_key *key )
+{
+	int r;
+	memcpy(key->rk_dec[0], key->rk_enc[AES_ROUNDS], AES_BLOCK);
+	for(r = 1; r < AES_ROUNDS; r++) {
+		__m128i k = _mm_loadu_si128((const __m128i *)key->rk_enc[AES_ROUNDS - r]);
+		_mm_storeu_si128((__m128i *)key->rk_dec[r], _mm_aesimc_si128(k));
+	}
+	memcpy(key->rk_dec[AES_ROUNDS], key->rk_enc[0], AES_BLOCK);
+}
+
+/* VAES: four 512-bit lanes of four blocks each, sixteen blocks in flight */
+__attribute__((target("vaes,avx512f,aes,sse4.1")))
+static void vaes_xts( const xts_key *key, unsigned char *data, const unsigned char *tweaks, int n, int decrypt )
+{
+	const unsigned char (*rk)[16] = decrypt ? key->rk_dec : key->rk_enc;
+	__m512i k[AES_ROUNDS + 1];
+	int i, j, r;
+
+	for(r = 0; r <= AES_ROUNDS; r++) {
+		k[r] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)rk[r]));
+	}
+
+	for(i = 0; i + 16 <= n; i += 16) {
+		__m512i b[4], t[4];
+		for(j = 0; j < 4; j++) {
+			t[j] = _mm512_loadu_si512(tweaks + (i + j * 4) * AES_BLOCK);
+			b[j] = _mm512_loadu_si512(data + (i + j * 4) * AES_BLOCK);
+			b[j] = _mm512_xor_si512(_mm512_xor_si512(b[j], t[j]), k[0]);
+		}
+		if(decrypt) {
+			for(r = 1; r < AES_ROUNDS; r++) {
+				for(j = 0; j < 4; j++) b[j] = _mm512_aesdec_epi128(b[j], k[r]);
+			}
+			for(j = 0; j < 4; j++) b[j] = _mm512_aesdeclast_epi128(b[j], k[AES_ROUNDS]);
+		} else {
+			for(r = 1; r < AES_ROUNDS; r++) {
+				for(j = 0; j < 4; j++) b[j] = _mm512_aesenc_epi128(b[j], k[r]);
+			}
+			for(j = 0; j < 4; j++) b[j] = _mm512_aesenclast_epi128(b[j], k[AES_ROUNDS]);
+		}
+		for(j = 0; j < 4; j++) {
+			_mm512_storeu_si512(data + (i + j * 4) * AES_BLOCK, _mm512_xor_si512(b[j], t[j]));
+		}
+	}
+
+	if(i < n) {
+		aesni_xts(key, data + i * AES_BLOCK, tweaks + i * AES_BLOCK, n - i, decrypt);
+	}
+}
+
+#endif
+
+void xts_setkey( xts_key *key, const unsigned char *raw )
+{
+	detect_impl();
+	expand_key(key->rk_enc, raw);
+	expand_key(key->rk_tweak, raw + AES_BLOCK);
+#ifdef HAVE_X86
+	if(impl != IMPL_SOFT) {
+		aesni_decrypt_schedule(key);
+	}
+#endif
+}
+
+/* Fills the tweak of every AES block in a data unit: the encrypted unit
+   number multiplied by successive powers of x in GF(2^128) */
+static void unit_tweaks( const xts_key *key, unsigned long long unitnum, unsigned char *tweaks, int n )
+{
+	uint64_t t[2];
+	int i;
+
+	memset(tweaks, 0, AES_BLOCK);
+	for(i = 0; i < 8; i++) {
+		tweaks[i] = (unitnum >> (8 * i)) & 0xff;
+	}
+#ifdef HAVE_X86
+	if(impl != IMPL_SOFT) {
+		aesni_encrypt_block(key->rk_tweak, tweaks);
+	} else
+#endif
+	soft_encrypt_block(key->rk_tweak, tweaks);
+
+	memcpy(t, tweaks, AES_BLOCK);
+	for(i = 1; i < n; i++) {
+		uint64_t carry = t[1] >> 63;
+		t[1] = (t[1] << 1) | (t[0] >> 63);
+		t[0] = (t[0] << 1) ^ (carry * 0x87);
+		memcpy(tweaks + i * AES_BLOCK, t, AES_BLOCK);
+	}
+}
+
+static void xts_units( const xts_key *key, unsigned long long unitnum, unsigned char *data, int unit_size, int nunits, int decrypt )
+{
+	int blocks_per_unit = unit_size / AES_BLOCK;
+	unsigned char tweaks[XTS_MAX_UNIT];
+	int u;
+
+	if(unit_size % AES_BLOCK || unit_size > XTS_MAX_UNIT) {
+		printf("ERROR: bad xts unit size (%d)\n", unit_size);
+		abort();
+	}
+
+	for(u = 0; u < nunits; u++) {
+		unsigned char *unit = data + (size_t)u * unit_size;
+		unit_tweaks(key, unitnum + u, tweaks, blocks_per_unit);
+		switch(impl) {
+#ifdef HAVE_X86
+		case IMPL_VAES:
+			vaes_xts(key, unit, tweaks, blocks_per_unit, decrypt);
+			break;
+		case IMPL_AESNI:
+			aesni_xts(key, unit, tweaks, blocks_per_unit, decrypt);
+			break;
+#endif
+		default:
+			soft_xts(key, unit, tweaks, blocks_per_unit, decrypt);
+		}
+	}
+}
+
+void xts_encrypt( const xts_key *key, unsigned long long unitnum, unsigned char *data, int unit_size, int nunits )
+{
+	xts_units(key, unitnum, data, unit_size, nunits, 0);
+}
+
+void xts_decrypt( const xts_key *key, unsigned long long unitnum, unsigned char *data, int unit_size, int nunits )
+{
+	xts_units(key, unitnum, data, unit_size, nunits, 1);
+}
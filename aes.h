@@ -0,0 +1,21 @@
+#ifndef AES_H
+#define AES_H
+
+#define XTS_KEY_SIZE 32	/* two AES-128 keys: data key, tweak key */
+#define XTS_MAX_UNIT 4096
+
+typedef struct {
+	unsigned char rk_enc[11][16];	/* data key, encryption schedule */
+	unsigned char rk_dec[11][16];	/* data key, AES-NI decryption schedule */
+	unsigned char rk_tweak[11][16];	/* tweak key, encryption schedule */
+} xts_key;
+
+void xts_setkey( xts_key *key, const unsigned char *raw );
+
+/* nunits data units of unit_size bytes, the first one tweaked with unitnum */
+void xts_encrypt( const xts_key *key, unsigned long long unitnum, unsigned char *data, int unit_size, int nunits );
+void xts_decrypt( const xts_key *key, unsigned long long unitnum, unsigned char *data, int unit_size, int nunits );
+
+const char *xts_impl_name();
+
+#endif
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "agroup.h"
+#include "freemap.h"
+
+#define ALLOC_WINDOWS 64	/* files with blocks reserved at a time, per group */
+#define ALLOC_WINDOW_BLOCKS 64	/* blocks reserved ahead of an appending file */
+#define MAX_EXTENT_PROBES 64	/* free extents examined per group and allocation */
+
+typedef struct {
+	int slot;
+	int start;		/* within the group */
+	int len;
+} alloc_window;
+
+/* Blocks [start, start + nblocks) of the disk; everything in it is
+   guarded by lock and numbered from start */
+typedef struct {
+	pthread_mutex_t lock;
+	int start, nblocks;
+	struct freemap *freemap;	/* NULL until the group is loaded */
+
+	/* blocks reserved for the next appends of recently extended files,
+	   kept out of the freemap so other files allocate elsewhere; the
+	   window of slot s is windows[s % ALLOC_WINDOWS] */
+	alloc_window windows[ALLOC_WINDOWS];
+	int nreserved;
+
+	agroups_stats stats;
+} group;
+
+struct agroups {
+	int nblocks;
+	int ngroups;
+	int group_blocks;
+	group *groups;
+
+	agroups_loader load;
+	void *arg;
+	int unloaded_free;	/* free blocks of the groups not loaded */
+};
+
+/* Handed out to threads on their first allocation, on any disk */
+static int next_home = 0;
+static __thread int home = -1;
+
+/* Reads which blocks of g are free unless that is known; the caller
+   holds its lock */
+static void load_group( struct agroups *groups, group *g )
+{
+	if(g->freemap) return;
+	g->freemap = freemap_init(g->nblocks);
+	groups->load(groups->arg, g->start, g->nblocks, g->freemap);
+	__atomic_sub_fetch(&groups->unloaded_free, freemap_count(g->freemap), __ATOMIC_RELAXED);
+}
+
+struct agroups *agroups_init( int nblocks, int nfree, agroups_loader load, void *arg )
+{
+	struct agroups *groups = calloc(1, sizeof(struct agroups));
+	int i;
+
+	groups->nblocks = nblocks;
+	groups->ngroups = nblocks / AGROUP_MIN_BLOCKS;
+	if(groups->ngroups < 1) groups->ngroups = 1;
+	if(groups->ngroups > AGROUP_MAX) groups->ngroups = AGROUP_MAX;
+	groups->group_blocks = (nblocks + groups->ngroups - 1) / groups->ngroups;
+	groups->groups = calloc(groups->ngroups, sizeof(group));
+
+	for(i = 0; i < groups->ngroups; i++) {
+		group *g = &groups->groups[i];
+		g->start = i * groups->group_blocks;
+		g->nblocks = nblocks - g->start;
+		if(g->nblocks > groups->group_blocks) g->nblocks = groups->group_blocks;
+		pthread_mutex_init(&g->lock, NULL);
+	}
+
+	groups->load = load;
+	groups->arg = arg;
+	if(nfree >= 0) {
+		groups->unloaded_free = nfree;
+	} else {
+		for(i = 0; i < groups->ngroups; i++) {
+			load_group(groups, &groups->groups[i]);
+		}
+		groups->unloaded_free = 0;
+	}
+	return groups;
+}
+
+void agroups_destroy( struct agroups *groups )
+{
+	int i;
+	if(!groups) return;
+	for(i = 0; i < groups->ngroups; i++) {
+		freemap_destroy(groups->groups[i].freemap);
+		pthread_mutex_destroy(&groups->groups[i].lock);
+	}
+	free(groups->groups);
+	free(groups);
+}
+
+int agroups_count( struct agroups *groups )
+{
+	return groups->ngroups;
+}
+
+int agroups_home( struct agroups *groups )
+{
+	if(home < 0) home = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED);
+	return home % groups->ngroups;
+}
+
+static group *group_of( struct agroups *groups, int block )
+{
+	return &groups->groups[block / groups->group_blocks];
+}
+
+/* Locks g, counting it when another thread had it */
+static void lock_group( group *g )
+{
+	if(pthread_mutex_trylock(&g->lock) != 0) {
+		pthread_mutex_lock(&g->lock);
+		g->stats.waits++;
+	}
+}
+
+void agroups_load( struct agroups *groups, int block )
+{
+	group *g = group_of(groups, block);
+	pthread_mutex_lock(&g->lock);
+	load_group(groups, g);
+	pthread_mutex_unlock(&g->lock);
+}
+
+void agroups_set_free( struct agroups *groups, int block )
+{
+	group *g = group_of(groups, block);
+	pthread_mutex_lock(&g->lock);
+	load_group(groups, g);
+	freemap_set_free(g->freemap, block - g->start);
+	pthread_mutex_unlock(&g->lock);
+}
+
+void agroups_set_used( struct agroups *groups, int block )
+{
+	group *g = group_of(groups, block);
+	pthread_mutex_lock(&g->lock);
+	load_group(groups, g);
+	freemap_set_used(g->freemap, block - g->start);
+	pthread_mutex_unlock(&g->lock);
+}
+
+int agroups_free( struct agroups *groups )
+{
+	int i, nfree = __atomic_load_n(&groups->unloaded_free, __ATOMIC_RELAXED);
+	for(i = 0; i < groups->ngroups; i++) {
+		group *g = &groups->groups[i];
+		pthread_mutex_lock(&g->lock);
+		if(g->freemap) nfree += freemap_count(g->freemap) + g->nreserved;
+		pthread_mutex_unlock(&g->lock);
+	}
+	return nfree;
+}
+
+int agroups_reserved( struct agroups *groups )
+{
+	int i, reserved = 0;
+	for(i = 0; i < groups->ngroups; i++) {
+		group *g = &groups->groups[i];
+		pthread_mutex_lock(&g->lock);
+		reserved += g->nreserved;
+		pthread_mutex_unlock(&g->lock);
+	}
+	return reserved;
+}
+
+/* Gives a window's reserved blocks back to the freemap */
+static void release_window( group *g, alloc_window *window )
+{
+	int i;
+	for(i = window->start; i < window->start + window->len; i++) {
+		freemap_set_free(g->freemap, i);
+	}
+	g->nreserved -= window->len;
+	window->len = 0;
+}
+
+/* Finds free blocks in g for need more blocks of a file: the run right
+   after goal if it is free, else the first run long enough for
+   everything from goal on, else the longest run seen. A goal of -1
+   searches from the start. Returns the start, the run length in *run */
+static int find_extent( group *g, int goal, int need, int *run )
+{
+	int want = need + ALLOC_WINDOW_BLOCKS;
+	int from = (goal >= 0) ? goal : 0;
+	int best = -1, best_len = 0, wrapped = 0, probes;
+	int pos = freemap_find(g->freemap, from);
+
+	for(probes = 0; probes < MAX_EXTENT_PROBES; probes++) {
+		if(pos < 0 || (wrapped && pos >= from)) {
+			if(wrapped) break;
+			wrapped = 1;
+			pos = freemap_find(g->freemap, 0);
+			if(pos < 0 || pos >= from) break;
+		}
+
+		int len = freemap_run(g->freemap, pos, want);
+		if(pos == goal || len >= need) {
+			*run = len;
+			return pos;
+		}
+		if(len > best_len) {
+			best = pos;
+			best_len = len;
+		}
+		pos = freemap_find(g->freemap, pos + len);
+	}
+
+	*run = best_len;
+	return best;
+}
+
+/* agroups_alloc within one group, goal is within it or -1; a run not
+   at the goal must be min blocks long. tally is the group's counter to
+   add the allocation to besides allocs, or NULL */
+static int alloc_in( struct agroups *groups, group *g, int slot, int goal, int need, int min, int *len, long long *tally )
+{
+	alloc_window *window = (slot >= 0) ? &g->windows[slot % ALLOC_WINDOWS] : NULL;
+	int start, run, i;
+
+	lock_group(g);
+	load_group(groups, g);
+	if(window && window->len > 0 && window->slot == slot && window->start == goal) {
+		start = window->start;
+		*len = (need < window->len) ? need : window->len;
+		window->start += *len;
+		window->len -= *len;
+		g->nreserved -= *len;
+	} else {
+		if(window && window->slot == slot) {
+			/* the file moved on, its blocks here are free again */
+			release_window(g, window);
+		}
+
+		start = find_extent(g, goal, need, &run);
+		if(start < 0 || (start != goal && run < min)) {
+			pthread_mutex_unlock(&g->lock);
+			return -1;
+		}
+
+		*len = (need < run) ? need : run;
+		for(i = start; i < start + *len; i++) {
+			freemap_set_used(g->freemap, i);
+		}
+
+		/* the rest of the run becomes the file's window */
+		if(window && run > need) {
+			release_window(g, window);
+			window->slot = slot;
+			window->start = start + need;
+			window->len = (run - need < ALLOC_WINDOW_BLOCKS) ? run - need : ALLOC_WINDOW_BLOCKS;
+			for(i = window->start; i < window->start + window->len; i++) {
+				freemap_set_used(g->freemap, i);
+			}
+			g->nreserved += window->len;
+		}
+	}
+
+	g->stats.allocs++;
+	if(tally) (*tally)++;
+	pthread_mutex_unlock(&g->lock);
+	return start;
+}
+
+int agroups_alloc( struct agroups *groups, int slot, int goal, int need, int *len )
+{
+	int order[AGROUP_MAX];
+	int n = 0, i, pass;
+	int mine = agroups_home(groups);
+	int first = (goal >= 0 && goal < groups->nblocks) ? (int)(group_of(groups, goal) - groups->groups) : mine;
+
+	/* the goal's group, then home, then the others from home on */
+	order[n++] = first;
+	for(i = 0; i < groups->ngroups; i++) {
+		int g = (mine + i) % groups->ngroups;
+		if(g != first) order[n++] = g;
+	}
+
+	for(pass = 0; pass < 2; pass++) {
+		for(i = 0; i < n; i++) {
+			group *g = &groups->groups[order[i]];
+			int local = (order[i] == first && goal >= 0 && goal < groups->nblocks) ? goal - g->start : -1;
+			long long *tally = (order[i] == mine) ? &g->stats.home :
+				(order[i] != first) ? &g->stats.steals : NULL;
+			int start = alloc_in(groups, g, slot, local, need, pass ? 1 : need, len, tally);
+			if(start >= 0) return g->start + start;
+		}
+	}
+	return -1;
+}
+
+void agroups_release( struct agroups *groups, int slot )
+{
+	int i;
+	for(i = 0; i < groups->ngroups; i++) {
+		group *g = &groups->groups[i];
+		alloc_window *window = &g->windows[slot % ALLOC_WINDOWS];
+		pthread_mutex_lock(&g->lock);
+		if(window->slot == slot) release_window(g, window);
+		pthread_mutex_unlock(&g->lock);
+	}
+}
+
+void agroups_release_all( struct agroups *groups )
+{
+	int i, w;
+	for(i = 0; i < groups->ngroups; i++) {
+		group *g = &groups->groups[i];
+		pthread_mutex_lock(&g->lock);
+		for(w = 0; w < ALLOC_WINDOWS; w++) {
+			release_window(g, &g->windows[w]);
+		}
+		pthread_mutex_unlock(&g->lock);
+	}
+}
+
+void agroups_get_stats( struct agroups *groups, agroups_stats *stats )
+{
+	int i;
+	memset(stats, 0, sizeof(agroups_stats));
+	for(i = 0; i < groups->ngroups; i++) {
+		group *g = &groups->groups[i];
+		pthread_mutex_lock(&g->lock);
+		stats->allocs += g->stats.allocs;
+		stats->home += g->stats.home;
+		stats->steals += g->stats.steals;
+		stats->waits += g->stats.waits;
+		if(g->freemap) stats->loaded++;
+		pthread_mutex_unlock(&g->lock);
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef AGROUP_H
+#define AGROUP_H
+
+/* Allocation groups: the disk split into ranges of blocks, each with
+   its own free map, lock and reservations, so threads allocating in
+   different groups never wait for each other. Every thread has a home
+   group it starts new files in, and takes blocks from the other groups
+   only when its own has no run that fits. A group learns which of its
+   blocks are free the first time it is used, so a mount that knows how
+   many are free does not read the whole fat. */
+
+#define AGROUP_MIN_BLOCKS 2048	/* smallest group, smaller disks get one */
+#define AGROUP_MAX 32
+
+struct agroups;
+struct freemap;
+
+typedef struct {
+	long long allocs;	/* runs handed out */
+	long long home;		/* of those, from the caller's home group */
+	long long steals;	/* from neither the home group nor the goal's */
+	long long waits;	/* allocations that found their group locked */
+	int loaded;		/* groups whose free blocks have been read */
+} agroups_stats;
+
+/* Marks in freemap, numbered from start, the free blocks among
+   [start, start + nblocks); runs with the group's lock held */
+typedef void (*agroups_loader)( void *arg, int start, int nblocks, struct freemap *freemap );
+
+/* Groups over nblocks blocks whose free blocks load tells. With nfree,
+   the number free, known each group is loaded when first used, with
+   nfree below 0 all of them are loaded now */
+struct agroups *agroups_init( int nblocks, int nfree, agroups_loader load, void *arg );
+void agroups_destroy( struct agroups *groups );
+
+int  agroups_count( struct agroups *groups );
+
+/* The calling thread's group, handed out round robin to threads */
+int  agroups_home( struct agroups *groups );
+
+/* Loads the group of block if it is not yet; a block's group must be
+   loaded before its entry changes between free and used */
+void agroups_load( struct agroups *groups, int block );
+
+void agroups_set_free( struct agroups *groups, int block );
+void agroups_set_used( struct agroups *groups, int block );
+
+/* Free blocks, counting those reserved for appending files */
+int  agroups_free( struct agroups *groups );
+int  agroups_reserved( struct agroups *groups );
+
+/* Takes a run of at most need free blocks for file slot and returns
+   its start, its length in *len, or -1 when no block is free. A goal
+   of 0 or more is the block after the file's last one: the run there
+   or the window reserved at it is taken when there is one. Otherwise
+   a run long enough for everything is looked for in the goal's group,
+   the caller's home group and then the others, and only when none has
+   one the longest run seen is taken. The rest of the run, up to a
+   window, is reserved for the file's next appends; a slot below 0
+   reserves nothing */
+int  agroups_alloc( struct agroups *groups, int slot, int goal, int need, int *len );
+
+/* Gives back the blocks reserved for slot, or for every file */
+void agroups_release( struct agroups *groups, int slot );
+void agroups_release_all( struct agroups *groups );
+
+void agroups_get_stats( struct agroups *groups, agroups_stats *stats );
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "bcache.h"
+#include "bufpool.h"
+
+#define NONE -1
+
+typedef struct {
+	int blocknum;
+	int dirty;
+	int prev, next;		/* lru list, most recent first */
+	int hash_next;
+} frame;
+
+typedef struct {
+	int blocknum;
+	int frame;
+} dirty_ref;
+
+struct bcache {
+	struct disk *disk;
+	int max_blocks;
+	int nframes;		/* frames handed out so far */
+	frame *frames;
+	char *data;
+
+	int *heads;		/* hash buckets of frame chains */
+	int nheads;		/* power of two */
+	int lru_head, lru_tail;
+
+	dirty_ref *dirty;	/* frames to write on flush */
+	int ndirty;
+
+	void (*writeback_hook)( void *arg );
+	void *hook_arg;
+
+	bcache_stats stats;
+};
+
+struct bcache *bcache_init( struct disk *disk, int max_blocks )
+{
+	struct bcache *cache = calloc(1, sizeof(struct bcache));
+	int i;
+
+	cache->disk = disk;
+	cache->max_blocks = max_blocks;
+	cache->frames = calloc(max_blocks, sizeof(frame));
+	cache->data = bufpool_alloc((long)max_blocks * DISK_BLOCK_SIZE);
+	cache->dirty = calloc(max_blocks, sizeof(dirty_ref));
+
+	cache->nheads = 1;
+	while(cache->nheads < 2 * max_blocks) cache->nheads *= 2;
+	cache->heads = malloc(cache->nheads * sizeof(int));
+	for(i = 0; i < cache->nheads; i++) cache->heads[i] = NONE;
+
+	cache->lru_head = cache->lru_tail = NONE;
+	return cache;
+}
+
+void bcache_destroy( struct bcache *cache )
+{
+	if(!cache) return;
+	bufpool_free(cache->data, (long)cache->max_blocks * DISK_BLOCK_SIZE);
+	free(cache->frames);
+	free(cache->dirty);
+	free(cache->heads);
+	free(cache);
+}
+
+static char *frame_data( struct bcache *cache, int f )
+{
+	return cache->data + (long)f * DISK_BLOCK_SIZE;
+}
+
+static int *bucket_of( struct bcache *cache, int blocknum )
+{
+	return &cache->heads[((unsigned int)blocknum * 2654435761u) & (cache->nheads - 1)];
+}
+
+static void lru_unlink( struct bcache *cache, int f )
+{
+	frame *fr = &cache->frames[f];
+	if(fr->prev != NONE) cache->frames[fr->prev].next = fr->next;
+	else cache->lru_head = fr->next;
+	if(fr->next != NONE) cache->frames[fr->next].prev = fr->prev;
+	else cache->lru_tail = fr->prev;
+}
+
+static void lru_push( struct bcache *cache, int f )
+{
+	frame *fr = &cache->frames[f];
+	fr->prev = NONE;
+	fr->next = cache->lru_head;
+	if(cache->lru_head != NONE) cache->frames[cache->lru_head].prev = f;
+	else cache->lru_tail = f;
+	cache->lru_head = f;
+}
+
+static int lookup( struct bcache *cache, int blocknum )
+{
+	int f = *bucket_of(cache, blocknum);
+	while(f != NONE && cache->frames[f].blocknum != blocknum) {
+		f = cache->frames[f].hash_next;
+	}
+	return f;
+}
+
+static void hash_remove( struct bcache *cache, int f )
+{
+	int *link = bucket_of(cache, cache->frames[f].blocknum);
+	while(*link != f) link = &cache->frames[*link].hash_next;
+	*link = cache->frames[f].hash_next;
+}
+
+static void write_frame( struct bcache *cache, int f )
+{
+	disk_write(cache->disk, cache->frames[f].blocknum, frame_data(cache, f));
+	cache->stats.writebacks++;
+}
+
+/* A frame for blocknum: a fresh one while under the cap, else the
+   least recently used one, written back first if it changed */
+static int take_frame( struct bcache *cache, int blocknum )
+{
+	int f;
+
+	if(cache->nframes < cache->max_blocks) {
+		f = cache->nframes++;
+	} else {
+		f = cache->lru_tail;
+		if(cache->frames[f].dirty && cache->writeback_hook) {
+			/* may flush, which leaves the frame clean and in place */
+			cache->writeback_hook(cache->hook_arg);
+		}
+		lru_unlink(cache, f);
+		hash_remove(cache, f);
+		if(cache->frames[f].dirty) {
+			int i;
+			write_frame(cache, f);
+			for(i = 0; cache->dirty[i].frame != f; i++);
+			cache->dirty[i] = cache->dirty[--cache->ndirty];
+		}
+		cache->stats.evictions++;
+	}
+
+	cache->frames[f].blocknum = blocknum;
+	cache->frames[f].dirty = 0;
+	cache->frames[f].hash_next = *bucket_of(cache, blocknum);
+	*bucket_of(cache, blocknum) = f;
+	lru_push(cache, f);
+	return f;
+}
+
+static void mark_frame( struct bcache *cache, int f )
+{
+	if(!cache->frames[f].dirty) {
+		cache->frames[f].dirty = 1;
+		cache->dirty[cache->ndirty].blocknum = cache->frames[f].blocknum;
+		cache->dirty[cache->ndirty].frame = f;
+		cache->ndirty++;
+	}
+}
+
+char *bcache_get( struct bcache *cache, int blocknum )
+{
+	int f = lookup(cache, blocknum);
+	if(f != NONE) {
+		cache->stats.hits++;
+		if(cache->lru_head != f) {
+			lru_unlink(cache, f);
+			lru_push(cache, f);
+		}
+		return frame_data(cache, f);
+	}
+
+	cache->stats.misses++;
+	f = take_frame(cache, blocknum);
+	disk_read(cache->disk, blocknum, frame_data(cache, f));
+	return frame_data(cache, f);
+}
+
+char *bcache_new( struct bcache *cache, int blocknum )
+{
+	int f = lookup(cache, blocknum);
+	if(f == NONE) {
+		f = take_frame(cache, blocknum);
+	} else if(cache->lru_head != f) {
+		lru_unlink(cache, f);
+		lru_push(cache, f);
+	}
+	memset(frame_data(cache, f), 0, DISK_BLOCK_SIZE);
+	mark_frame(cache, f);
+	return frame_data(cache, f);
+}
+
+void bcache_mark( struct bcache *cache, const void *ptr )
+{
+	mark_frame(cache, ((const char *)ptr - cache->data) / DISK_BLOCK_SIZE);
+}
+
+void bcache_set_writeback_hook( struct bcache *cache, void (*hook)( void *arg ), void *arg )
+{
+	cache->writeback_hook = hook;
+	cache->hook_arg = arg;
+}
+
+static int by_blocknum( const void *a, const void *b )
+{
+	return ((const dirty_ref *)a)->blocknum - ((const dirty_ref *)b)->blocknum;
+}
+
+void bcache_flush( struct bcache *cache )
+{
+	char *buf = NULL;
+	int i = 0;
+
+	if(cache->ndirty == 0) return;
+	if(cache->ndirty > 1) {
+		qsort(cache->dirty, cache->ndirty, sizeof(dirty_ref), by_blocknum);
+	}
+
+	while(i < cache->ndirty) {
+		int first = cache->dirty[i].frame;
+		int run = 1;
+		while(i + run < cache->ndirty && run < BUFPOOL_MAX_BLOCKS &&
+		      cache->dirty[i + run].blocknum == cache->dirty[i].blocknum + run) {
+			run++;
+		}
+
+		if(run == 1) {
+			write_frame(cache, first);
+		} else {
+			/* gather the run so it goes out in one request */
+			int j;
+			if(!buf) buf = bufpool_get(BUFPOOL_MAX_BLOCKS);
+			for(j = 0; j < run; j++) {
+				memcpy(buf + (long)j * DISK_BLOCK_SIZE, frame_data(cache, cache->dirty[i + j].frame), DISK_BLOCK_SIZE);
+			}
+			disk_write_blocks(cache->disk, cache->dirty[i].blocknum, run, buf);
+			cache->stats.writebacks += run;
+		}
+
+		for(; run > 0; run--, i++) {
+			cache->frames[cache->dirty[i].frame].dirty = 0;
+		}
+	}
+
+	if(buf) bufpool_put(buf, BUFPOOL_MAX_BLOCKS);
+	cache->ndirty = 0;
+}
+
+void bcache_get_stats( struct bcache *cache, bcache_stats *stats )
+{
+	*stats = cache->stats;
+}
@@ -0,0 +1,40 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+/* A write-back cache of disk blocks with a cap on the number kept in
+   memory; the least recently used clean or dirty block makes room.
+   A pointer returned for a block stays valid until cap - 1 other
+   blocks have been fetched. */
+
+struct disk;
+struct bcache;
+
+typedef struct {
+	long long hits;
+	long long misses;
+	long long evictions;
+	long long writebacks;	/* blocks written, by flush or eviction */
+} bcache_stats;
+
+struct bcache *bcache_init( struct disk *disk, int max_blocks );
+void bcache_destroy( struct bcache *cache );
+
+/* The cached contents of blocknum, read from disk on a miss */
+char *bcache_get( struct bcache *cache, int blocknum );
+
+/* A zeroed, dirty buffer for blocknum without reading the disk */
+char *bcache_new( struct bcache *cache, int blocknum );
+
+/* Marks the block whose cached data holds ptr as changed */
+void bcache_mark( struct bcache *cache, const void *ptr );
+
+/* Writes the changed blocks, adjacent ones in one request */
+void bcache_flush( struct bcache *cache );
+
+/* Calls hook(arg) before a changed block is evicted and written, so the
+   owner can first make the change safe to land in place */
+void bcache_set_writeback_hook( struct bcache *cache, void (*hook)( void *arg ), void *arg );
+
+void bcache_get_stats( struct bcache *cache, bcache_stats *stats );
+
+#endif
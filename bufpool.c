@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "disk.h"
+#include "bufpool.h"
+
+#define ARENA_SIZE (2*1024*1024)
+#define NCLASSES 5	/* 1, 2, 4, 8 and 16 blocks */
+
+typedef struct free_buf {
+	struct free_buf *next;
+} free_buf;
+
+typedef struct {
+	free_buf *lists[NCLASSES];
+	int registered;
+} thread_cache;
+
+static __thread thread_cache cache;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* buffers left behind by threads that exited */
+static free_buf *orphans[NCLASSES];
+
+static char *arena_next = NULL;
+static long arena_left = 0;
+
+static bufpool_stats stats;
+
+#define count(field) __atomic_fetch_add(&stats.field, 1, __ATOMIC_RELAXED)
+
+static int size_class( int nblocks )
+{
+	int c = 0;
+	if(nblocks < 1 || nblocks > BUFPOOL_MAX_BLOCKS) {
+		printf("ERROR: buffer of %d blocks requested!\n", nblocks);
+		abort();
+	}
+	while((1 << c) < nblocks) c++;
+	return c;
+}
+
+/* Maps size bytes (a multiple of ARENA_SIZE) on huge pages: explicit
+   ones when the system has them reserved, else a 2 MiB aligned region
+   offered to transparent huge pages */
+static char *map_huge( long size )
+{
+	char *raw, *aligned;
+
+	raw = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if(raw != MAP_FAILED) {
+		count(huge_arenas);
+		return raw;
+	}
+
+	raw = mmap(NULL, size + ARENA_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(raw == MAP_FAILED) {
+		return NULL;
+	}
+
+	aligned = (char *)(((uintptr_t)raw + ARENA_SIZE - 1) & ~(uintptr_t)(ARENA_SIZE - 1));
+	if(aligned > raw) {
+		munmap(raw, aligned - raw);
+	}
+	munmap(aligned + size, raw + ARENA_SIZE - aligned);
+	madvise(aligned, size, MADV_HUGEPAGE);
+	return aligned;
+}
+
+static void release_cache( void *arg )
+{
+	thread_cache *tc = arg;
+	int c;
+
+	pthread_mutex_lock(&lock);
+	for(c = 0; c < NCLASSES; c++) {
+		while(tc->lists[c]) {
+			free_buf *b = tc->lists[c];
+			tc->lists[c] = b->next;
+			b->next = orphans[c];
+			orphans[c] = b;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* a later destructor that uses the pool registers it again */
+	tc->registered = 0;
+}
+
+static void make_key()
+{
+	pthread_key_create(&cache_key, release_cache);
+}
+
+/* Makes the thread's free lists go to the orphans when it exits */
+static void register_cache()
+{
+	pthread_once(&once, make_key);
+	pthread_setspecific(cache_key, &cache);
+	cache.registered = 1;
+}
+
+/* Splits what is left of the arena into buffers for the orphan lists,
+   largest first; the caller holds the lock */
+static void retire_arena()
+{
+	int c;
+	for(c = NCLASSES - 1; c >= 0; c--) {
+		long bytes = (long)DISK_BLOCK_SIZE << c;
+		while(arena_left >= bytes) {
+			free_buf *b = (free_buf *)arena_next;
+			b->next = orphans[c];
+			orphans[c] = b;
+			arena_next += bytes;
+			arena_left -= bytes;
+		}
+	}
+}
+
+/* Slow path: an orphaned buffer or a fresh one from the arena */
+static char *refill( int c )
+{
+	long bytes = (long)DISK_BLOCK_SIZE << c;
+	char *buf;
+
+	if(!cache.registered) register_cache();
+
+	pthread_mutex_lock(&lock);
+	if(orphans[c]) {
+		buf = (char *)orphans[c];
+		orphans[c] = orphans[c]->next;
+		pthread_mutex_unlock(&lock);
+		count(cache_hits);
+		return buf;
+	}
+
+	if(arena_left < bytes) {
+		retire_arena();
+		arena_next = map_huge(ARENA_SIZE);
+		if(!arena_next) {
+			pthread_mutex_unlock(&lock);
+			printf("ERROR: out of memory for I/O buffers\n");
+			abort();
+		}
+		arena_left = ARENA_SIZE;
+		count(arenas);
+	}
+	buf = arena_next;
+	arena_next += bytes;
+	arena_left -= bytes;
+	pthread_mutex_unlock(&lock);
+
+	count(carved);
+	return buf;
+}
+
+char *bufpool_get( int nblocks )
+{
+	int c = size_class(nblocks);
+	free_buf *b = cache.lists[c];
+
+	count(gets);
+	if(b) {
+		cache.lists[c] = b->next;
+		count(cache_hits);
+		return (char *)b;
+	}
+	return refill(c);
+}
+
+void bufpool_put( char *buf, int nblocks )
+{
+	int c = size_class(nblocks);
+	free_buf *b = (free_buf *)buf;
+
+	if(!cache.registered) register_cache();
+	b->next = cache.lists[c];
+	cache.lists[c] = b;
+}
+
+/* Big allocations are rounded to whole huge pages, small ones to blocks */
+static long mapped_size( long size )
+{
+	if(size >= ARENA_SIZE) {
+		return (size + ARENA_SIZE - 1) / ARENA_SIZE * ARENA_SIZE;
+	}
+	return (size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE * DISK_BLOCK_SIZE;
+}
+
+void *bufpool_alloc( long size )
+{
+	long len = mapped_size(size);
+	void *mem;
+
+	count(large);
+	if(len >= ARENA_SIZE) {
+		mem = map_huge(len);
+	} else {
+		mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED) mem = NULL;
+	}
+
+	if(!mem) {
+		printf("ERROR: couldn't allocate %ld bytes\n", size);
+		abort();
+	}
+	return mem;
+}
+
+void bufpool_free( void *mem, long size )
+{
+	if(mem) {
+		munmap(mem, mapped_size(size));
+	}
+}
+
+void bufpool_get_stats( bufpool_stats *s )
+{
+	s->gets = __atomic_load_n(&stats.gets, __ATOMIC_RELAXED);
+	s->cache_hits = __atomic_load_n(&stats.cache_hits, __ATOMIC_RELAXED);
+	s->carved = __atomic_load_n(&stats.carved, __ATOMIC_RELAXED);
+	s->arenas = __atomic_load_n(&stats.arenas, __ATOMIC_RELAXED);
+	s->huge_arenas = __atomic_load_n(&stats.huge_arenas, __ATOMIC_RELAXED);
+	s->large = __atomic_load_n(&stats.large, __ATOMIC_RELAXED);
+}
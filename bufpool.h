@@ -0,0 +1,30 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+/* Block-aligned I/O buffers. Small runs of blocks come from per-thread
+   free lists carved out of huge-page arenas, so a steady-state I/O path
+   never touches the heap. */
+
+#define BUFPOOL_MAX_BLOCKS 16
+
+typedef struct {
+	long long gets;		/* buffers handed out */
+	long long cache_hits;	/* ... straight from a thread's free list */
+	long long carved;	/* ... carved from an arena, first use */
+	long long arenas;	/* arena mappings made */
+	long long huge_arenas;	/* ... backed by explicit huge pages */
+	long long large;	/* bufpool_alloc calls */
+} bufpool_stats;
+
+/* A buffer of nblocks (1..BUFPOOL_MAX_BLOCKS) blocks, returned with the
+   same count */
+char *bufpool_get( int nblocks );
+void bufpool_put( char *buf, int nblocks );
+
+/* Long-lived, zeroed, block-aligned memory of any size */
+void *bufpool_alloc( long size );
+void bufpool_free( void *mem, long size );
+
+void bufpool_get_stats( bufpool_stats *stats );
+
+#endif
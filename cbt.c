@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "cbt.h"
+#include "bufpool.h"
+
+#define NO_CHECKPOINT "No checkpoint: run checkpoint <name> first"
+#define CHECKPOINT_NAME_TOO_LONG "Checkpoint name too long"
+#define BAD_CBT_FILE "Changed-block map is corrupt, tracking disabled"
+#define BAD_DELTA_FILE "Not a delta file"
+#define DELTA_TOO_BIG "Delta is for a bigger disk"
+#define WRONG_BASE "Disk is not at the checkpoint the delta starts from"
+#define WRONG_CIPHER "Delta and disk differ in encryption"
+
+#define CBT_MAGIC   0xcb7c0001
+#define DELTA_MAGIC 0xde17a002
+
+/* blocks moved per disk request while exporting or applying */
+#define CHUNK_BLOCKS BUFPOOL_MAX_BLOCKS
+#define chunk_size(n) (((n) > CHUNK_BLOCKS) ? CHUNK_BLOCKS : (n))
+
+typedef struct {
+	unsigned int magic;
+	int nblocks;
+	char name[CBT_NAME_LEN+1];
+} cbt_header;
+
+/* delta file: header, then nextents times { delta_extent, count blocks }.
+   Blocks are stored as on disk, so a delta of an encrypted image holds
+   ciphertext and only applies to an image with the same key */
+typedef struct {
+	unsigned int magic;
+	int nblocks;
+	int nextents;
+	int nchanged;
+	int encrypted;
+	char base[CBT_NAME_LEN+1];	/* checkpoint the target must be at */
+	char name[CBT_NAME_LEN+1];	/* checkpoint it is at afterwards, "" for none */
+} delta_header;
+
+typedef struct {
+	int start;
+	int count;
+} delta_extent;
+
+struct cbt {
+	char *path;
+	int nblocks;
+	cbt_header *map;
+	unsigned char *bitmap;
+	size_t maplen;
+
+	/* marks share it, starting a checkpoint takes it alone so no mark
+	   lands in a bitmap that is being cleared */
+	pthread_rwlock_t lock;
+};
+
+static int is_changed( const unsigned char *bitmap, int blocknum )
+{
+	return bitmap[blocknum >> 3] & (1 << (blocknum & 7));
+}
+
+/* Maps the tracking file, creating it when asked to */
+static int map_file( struct cbt *cbt, int create )
+{
+	int fd;
+
+	fd = open(cbt->path, O_RDWR | (create ? O_CREAT : 0), 0644);
+	if(fd < 0) {
+		return 0;
+	}
+
+	cbt->maplen = sizeof(cbt_header) + (cbt->nblocks + 7) / 8;
+	if(ftruncate(fd, cbt->maplen) < 0) {
+		close(fd);
+		return 0;
+	}
+
+	cbt->map = mmap(NULL, cbt->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(cbt->map == MAP_FAILED) {
+		cbt->map = NULL;
+		return 0;
+	}
+
+	cbt->bitmap = (unsigned char *)(cbt->map + 1);
+	return 1;
+}
+
+static void unmap_file( struct cbt *cbt )
+{
+	if(cbt->map) {
+		msync(cbt->map, cbt->maplen, MS_SYNC);
+		munmap(cbt->map, cbt->maplen);
+	}
+	cbt->map = NULL;
+	cbt->bitmap = NULL;
+}
+
+/* Picks up an existing tracking file for the image; blocks are only
+   tracked once a checkpoint exists */
+struct cbt *cbt_init( const char *diskfile, int n )
+{
+	struct cbt *cbt = calloc(1, sizeof(struct cbt));
+
+	cbt->path = malloc(strlen(diskfile) + 5);
+	sprintf(cbt->path, "%s.cbt", diskfile);
+	cbt->nblocks = n;
+	pthread_rwlock_init(&cbt->lock, NULL);
+
+	if(access(cbt->path, F_OK) != 0) {
+		return cbt;
+	}
+
+	if(!map_file(cbt, 0)) {
+		return cbt;
+	}
+
+	if(cbt->map->magic != CBT_MAGIC) {
+		printf("%s\n", BAD_CBT_FILE);
+		unmap_file(cbt);
+		return cbt;
+	}
+
+	/* a grown disk keeps its map, new blocks start out unchanged */
+	cbt->map->nblocks = n;
+	return cbt;
+}
+
+/* Called once the write of the blocks is done, so a checkpoint taken
+   before the mark finds them written */
+void cbt_mark( struct cbt *cbt, int blocknum, int count )
+{
+	pthread_rwlock_rdlock(&cbt->lock);
+	while(cbt->bitmap && count-- > 0) {
+		__atomic_fetch_or(&cbt->bitmap[blocknum >> 3], 1 << (blocknum & 7), __ATOMIC_RELAXED);
+		blocknum++;
+	}
+	pthread_rwlock_unlock(&cbt->lock);
+}
+
+void cbt_close( struct cbt *cbt )
+{
+	unmap_file(cbt);
+	pthread_rwlock_destroy(&cbt->lock);
+	free(cbt->path);
+	free(cbt);
+}
+
+/* Clears the bitmap and names the new period; the caller holds the
+   lock for writing */
+static int start_checkpoint( struct cbt *cbt, const char *name )
+{
+	if(!cbt->map && !map_file(cbt, 1)) {
+		printf("couldn't create %s: %s\n", cbt->path, strerror(errno));
+		return -1;
+	}
+
+	memset(cbt->bitmap, 0, cbt->maplen - sizeof(cbt_header));
+	cbt->map->nblocks = cbt->nblocks;
+	strcpy(cbt->map->name, name);
+	cbt->map->magic = CBT_MAGIC;
+	msync(cbt->map, cbt->maplen, MS_SYNC);
+	return 0;
+}
+
+/* Starts a new tracking period named name */
+int cbt_checkpoint( struct cbt *cbt, const char *name )
+{
+	int r;
+
+	if(strlen(name) > CBT_NAME_LEN) {
+		printf("%s\n", CHECKPOINT_NAME_TOO_LONG);
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&cbt->lock);
+	r = start_checkpoint(cbt, name);
+	pthread_rwlock_unlock(&cbt->lock);
+	return r;
+}
+
+const char *cbt_name( struct cbt *cbt )
+{
+	return cbt->map ? cbt->map->name : NULL;
+}
+
+/* Number of blocks written since the checkpoint */
+int cbt_changed( struct cbt *cbt )
+{
+	int i, changed = 0;
+
+	if(!cbt->map) return -1;
+
+	for(i = 0; i < (cbt->nblocks + 7) / 8; i++) {
+		changed += __builtin_popcount(__atomic_load_n(&cbt->bitmap[i], __ATOMIC_RELAXED));
+	}
+	return changed;
+}
+
+/* Writes the blocks changed since the checkpoint to deltafile, as
+   stored on the disk, and returns how many. With next, the changes are
+   taken and the period named next started in one step, so every write
+   lands in this delta or the next one; a block written while the export
+   runs may go out in both. A failed export puts the changes back */
+int cbt_export( struct disk *disk, const char *deltafile, const char *next )
+{
+	struct cbt *cbt = disk_cbt(disk);
+	FILE *file;
+	delta_header header;
+	delta_extent extent;
+	unsigned char *changed;
+	char *chunk;
+	size_t bitmap_len, i;
+	int block = 0, ok;
+
+	if(!cbt->map) {
+		printf("%s\n", NO_CHECKPOINT);
+		return -1;
+	}
+	if(next && strlen(next) > CBT_NAME_LEN) {
+		printf("%s\n", CHECKPOINT_NAME_TOO_LONG);
+		return -1;
+	}
+
+	file = fopen(deltafile, "w");
+	if(!file) {
+		printf("couldn't open %s: %s\n", deltafile, strerror(errno));
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = DELTA_MAGIC;
+	header.nblocks = cbt->nblocks;
+	header.encrypted = (disk_cipher(disk) != NULL);
+
+	bitmap_len = cbt->maplen - sizeof(cbt_header);
+	changed = malloc(bitmap_len);
+	pthread_rwlock_wrlock(&cbt->lock);
+	memcpy(changed, cbt->bitmap, bitmap_len);
+	strcpy(header.base, cbt->map->name);
+	if(next) {
+		strcpy(header.name, next);
+		start_checkpoint(cbt, next);
+	}
+	pthread_rwlock_unlock(&cbt->lock);
+	fwrite(&header, sizeof(header), 1, file);
+
+	chunk = bufpool_get(CHUNK_BLOCKS);
+	while(block < cbt->nblocks) {
+		if(!is_changed(changed, block)) {
+			block++;
+			continue;
+		}
+
+		extent.start = block;
+		while(block < cbt->nblocks && is_changed(changed, block)) block++;
+		extent.count = block - extent.start;
+		fwrite(&extent, sizeof(extent), 1, file);
+
+		int done = 0;
+		while(done < extent.count) {
+			int n = chunk_size(extent.count - done);
+			disk_read_raw_blocks(disk, extent.start + done, n, chunk);
+			fwrite(chunk, DISK_BLOCK_SIZE, n, file);
+			done += n;
+		}
+
+		header.nextents++;
+		header.nchanged += extent.count;
+	}
+	bufpool_put(chunk, CHUNK_BLOCKS);
+
+	fseek(file, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, file);
+
+	ok = (fclose(file) == 0);
+	if(!ok) {
+		printf("couldn't write %s: %s\n", deltafile, strerror(errno));
+	}
+	if(!ok && next) {
+		/* back to the old period, the changes since are kept as well */
+		pthread_rwlock_wrlock(&cbt->lock);
+		for(i = 0; i < bitmap_len; i++) {
+			cbt->bitmap[i] |= changed[i];
+		}
+		strcpy(cbt->map->name, header.base);
+		msync(cbt->map, cbt->maplen, MS_SYNC);
+		pthread_rwlock_unlock(&cbt->lock);
+	}
+	free(changed);
+
+	return ok ? header.nchanged : -1;
+}
+
+/* Replays deltafile onto the disk, which must be at the checkpoint the
+   delta starts from and encrypted the same way; afterwards it is at the
+   checkpoint the delta ends at, if it names one. Returns the number of
+   blocks written */
+int cbt_apply( struct disk *disk, const char *deltafile )
+{
+	struct cbt *cbt = disk_cbt(disk);
+	FILE *file;
+	delta_header header;
+	delta_extent extent;
+	char *chunk;
+	int i, written = 0;
+
+	file = fopen(deltafile, "r");
+	if(!file) {
+		printf("couldn't open %s: %s\n", deltafile, strerror(errno));
+		return -1;
+	}
+
+	if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != DELTA_MAGIC) {
+		printf("%s\n", BAD_DELTA_FILE);
+		fclose(file);
+		return -1;
+	}
+
+	if(header.nblocks > disk_size(disk)) {
+		printf("%s\n", DELTA_TOO_BIG);
+		fclose(file);
+		return -1;
+	}
+
+	if(header.encrypted != (disk_cipher(disk) != NULL)) {
+		printf("%s\n", WRONG_CIPHER);
+		fclose(file);
+		return -1;
+	}
+
+	header.base[CBT_NAME_LEN] = 0;
+	header.name[CBT_NAME_LEN] = 0;
+	if(!cbt_name(cbt) || strcmp(cbt_name(cbt), header.base)) {
+		printf("%s %s\n", WRONG_BASE, header.base);
+		fclose(file);
+		return -1;
+	}
+
+	chunk = bufpool_get(CHUNK_BLOCKS);
+	for(i = 0; i < header.nextents; i++) {
+		if(fread(&extent, sizeof(extent), 1, file) != 1
+		   || extent.start < 0 || extent.count < 1
+		   || extent.start + extent.count > header.nblocks) {
+			written = -1;
+			break;
+		}
+
+		int done = 0;
+		while(done < extent.count) {
+			int n = chunk_size(extent.count - done);
+			if(fread(chunk, DISK_BLOCK_SIZE, n, file) != n) {
+				break;
+			}
+			disk_write_raw_blocks(disk, extent.start + done, n, chunk);
+			done += n;
+		}
+		if(done < extent.count) {
+			written = -1;
+			break;
+		}
+		written += extent.count;
+	}
+	bufpool_put(chunk, CHUNK_BLOCKS);
+
+	if(written < 0) {
+		printf("%s\n", BAD_DELTA_FILE);
+	} else if(header.name[0]) {
+		cbt_checkpoint(cbt, header.name);
+	}
+	fclose(file);
+	return written;
+}
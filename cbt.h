@@ -0,0 +1,26 @@
+#ifndef CBT_H
+#define CBT_H
+
+/* Changed-block tracking: a bitmap of blocks written since the last
+   checkpoint, kept in <diskfile>.cbt next to the image */
+
+#define CBT_NAME_LEN 31
+
+struct disk;
+struct cbt;
+
+struct cbt *cbt_init( const char *diskfile, int nblocks );
+void cbt_mark( struct cbt *cbt, int blocknum, int count );
+void cbt_close( struct cbt *cbt );
+
+int  cbt_checkpoint( struct cbt *cbt, const char *name );
+const char *cbt_name( struct cbt *cbt );
+int  cbt_changed( struct cbt *cbt );
+
+/* Deltas: export writes the blocks changed since the checkpoint and,
+   with next not NULL, starts the checkpoint next at the same moment;
+   apply takes a delta only on a disk at the checkpoint it starts from */
+int  cbt_export( struct disk *disk, const char *deltafile, const char *next );
+int  cbt_apply( struct disk *disk, const char *deltafile );
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dirindex.h"
+#include "bufpool.h"
+
+#define EMPTY -1
+#define DELETED -2
+
+#define MIN_CAPACITY 64
+#define FILTER_RATIO 4		/* filter counters per table bucket */
+#define FILTER_MAX 255
+
+typedef struct {
+	unsigned int hash;
+	int slot;
+	char name[DIRINDEX_NAME_LEN];
+} bucket;
+
+struct dirindex {
+	bucket *table;
+	int capacity;		/* power of two */
+	int used;		/* live buckets */
+	int deleted;		/* tombstones */
+
+	uint8_t *filter;	/* counting Bloom filter */
+	int filter_size;	/* power of two */
+};
+
+/* FNV-1a */
+unsigned int dirindex_hash( const char *name )
+{
+	unsigned int h = 2166136261u;
+	while(*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* The two filter counters of a hash */
+static int filter_pos( struct dirindex *index, unsigned int hash, int which )
+{
+	unsigned int h = which ? (hash >> 16 | hash << 16) * 0x9e3779b1u : hash;
+	return h & (index->filter_size - 1);
+}
+
+static void filter_add( struct dirindex *index, unsigned int hash )
+{
+	int i;
+	for(i = 0; i < 2; i++) {
+		uint8_t *c = &index->filter[filter_pos(index, hash, i)];
+		if(*c < FILTER_MAX) (*c)++;
+	}
+}
+
+static void filter_sub( struct dirindex *index, unsigned int hash )
+{
+	int i;
+	for(i = 0; i < 2; i++) {
+		uint8_t *c = &index->filter[filter_pos(index, hash, i)];
+		/* a saturated counter no longer knows its count, leave it */
+		if(*c > 0 && *c < FILTER_MAX) (*c)--;
+	}
+}
+
+static void alloc_tables( struct dirindex *index, int capacity )
+{
+	int i;
+	index->capacity = capacity;
+	index->table = bufpool_alloc((long)capacity * sizeof(bucket));
+	for(i = 0; i < capacity; i++) {
+		index->table[i].slot = EMPTY;
+	}
+	index->filter_size = capacity * FILTER_RATIO;
+	index->filter = bufpool_alloc(index->filter_size);
+	index->used = 0;
+	index->deleted = 0;
+}
+
+static void free_tables( struct dirindex *index )
+{
+	bufpool_free(index->table, (long)index->capacity * sizeof(bucket));
+	bufpool_free(index->filter, index->filter_size);
+}
+
+/* Room for nentries entries at under half load */
+struct dirindex *dirindex_init( int nentries )
+{
+	struct dirindex *index = calloc(1, sizeof(struct dirindex));
+	int capacity = MIN_CAPACITY;
+	while(capacity < 2 * nentries) capacity *= 2;
+	alloc_tables(index, capacity);
+	return index;
+}
+
+void dirindex_destroy( struct dirindex *index )
+{
+	if(!index) return;
+	free_tables(index);
+	free(index);
+}
+
+static void put( struct dirindex *index, unsigned int hash, const char *name, int slot )
+{
+	int mask = index->capacity - 1;
+	int i = hash & mask;
+	while(index->table[i].slot >= 0) {
+		i = (i + 1) & mask;
+	}
+	if(index->table[i].slot == DELETED) index->deleted--;
+	index->table[i].hash = hash;
+	index->table[i].slot = slot;
+	strncpy(index->table[i].name, name, DIRINDEX_NAME_LEN - 1);
+	index->table[i].name[DIRINDEX_NAME_LEN - 1] = 0;
+	index->used++;
+	filter_add(index, hash);
+}
+
+/* The bucket holding name, NULL if there is none */
+static bucket *find( struct dirindex *index, const char *name )
+{
+	unsigned int hash = dirindex_hash(name);
+	int mask = index->capacity - 1;
+	int i = hash & mask, probes;
+
+	if(!dirindex_maybe(index, hash)) return NULL;
+	for(probes = 0; probes < index->capacity; probes++) {
+		bucket *b = &index->table[i];
+		if(b->slot == EMPTY) break;
+		if(b->slot >= 0 && b->hash == hash && !strncmp(b->name, name, DIRINDEX_NAME_LEN)) return b;
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+/* Rehashes into a table sized for the live entries, dropping tombstones */
+static void resize( struct dirindex *index )
+{
+	bucket *old = index->table;
+	int i, old_capacity = index->capacity;
+	int capacity = MIN_CAPACITY;
+
+	while(capacity < 4 * index->used) capacity *= 2;
+	bufpool_free(index->filter, index->filter_size);
+	alloc_tables(index, capacity);
+	for(i = 0; i < old_capacity; i++) {
+		if(old[i].slot >= 0) put(index, old[i].hash, old[i].name, old[i].slot);
+	}
+	bufpool_free(old, (long)old_capacity * sizeof(bucket));
+}
+
+int dirindex_maybe( struct dirindex *index, unsigned int hash )
+{
+	return index->filter[filter_pos(index, hash, 0)] && index->filter[filter_pos(index, hash, 1)];
+}
+
+int dirindex_find( struct dirindex *index, const char *name )
+{
+	bucket *b = find(index, name);
+	return b ? b->slot : -1;
+}
+
+void dirindex_insert( struct dirindex *index, const char *name, int slot )
+{
+	if(2 * (index->used + index->deleted + 1) > index->capacity) resize(index);
+	put(index, dirindex_hash(name), name, slot);
+}
+
+void dirindex_remove( struct dirindex *index, const char *name )
+{
+	bucket *b = find(index, name);
+	if(b) {
+		b->slot = DELETED;
+		index->used--;
+		index->deleted++;
+		filter_sub(index, b->hash);
+	}
+}
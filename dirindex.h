@@ -0,0 +1,27 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+/* In-memory index from file names to directory slots. Lookups probe
+   an open-addressing table that keeps its own copy of every name, so
+   they never read the directory; a counting Bloom filter in front of
+   it turns most misses away without touching the table. */
+
+#define DIRINDEX_NAME_LEN 8	/* longest name kept, with its terminator */
+
+struct dirindex;
+
+struct dirindex *dirindex_init( int nentries );
+void dirindex_destroy( struct dirindex *index );
+
+unsigned int dirindex_hash( const char *name );
+
+/* 0 if no name with this hash was ever inserted and not removed */
+int  dirindex_maybe( struct dirindex *index, unsigned int hash );
+
+/* The slot of name, -1 if it is not in the index */
+int  dirindex_find( struct dirindex *index, const char *name );
+
+void dirindex_insert( struct dirindex *index, const char *name, int slot );
+void dirindex_remove( struct dirindex *index, const char *name );
+
+#endif
@@ -3,44 +3,105 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "disk.h"
+#include "aes.h"
+#include "cbt.h"
+#include "qos.h"
+#include "bufpool.h"
 
+/* blocks encrypted per pwrite on the bulk write path */
+#define CRYPT_CHUNK_BLOCKS 16
 
-static FILE *diskfile;
-static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+struct disk {
+	int fd;
+	int nblocks;
+	int nreads;
+	int nwrites;
 
-int disk_init( const char *filename, int n )
+	xts_key key;
+	int encrypted;
+
+	struct cbt *cbt;
+	struct qos *qos;
+
+	/* group sync: callers wait for the first fdatasync started after
+	   they arrived, so one call covers everyone queued behind it */
+	pthread_mutex_t sync_lock;
+	pthread_cond_t sync_cond;
+	int syncing;
+	long syncs_started;
+	long syncs_finished;
+	int nsync_requests;
+};
+
+struct disk *disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	struct disk *disk;
+	int fd;
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	fd = open(filename,O_RDWR|O_CREAT,0644);
+	if(fd<0) return NULL;
 
-	nblocks = n;
-	nreads = 0;
-	nwrites = 0;
+	if(ftruncate(fd,(off_t)n*DISK_BLOCK_SIZE)<0) {
+		close(fd);
+		return NULL;
+	}
+
+	disk = calloc(1,sizeof(struct disk));
+	disk->fd = fd;
+	disk->nblocks = n;
+	disk->cbt = cbt_init(filename,n);
+	disk->qos = qos_init();
+	pthread_mutex_init(&disk->sync_lock,NULL);
+	pthread_cond_init(&disk->sync_cond,NULL);
+
+	return disk;
+}
 
+int disk_set_key( struct disk *disk, const unsigned char *key )
+{
+	xts_setkey(&disk->key,key);
+	disk->encrypted = 1;
 	return 1;
 }
 
-int disk_size()
+const char *disk_cipher( struct disk *disk )
+{
+	return disk->encrypted ? xts_impl_name() : NULL;
+}
+
+struct cbt *disk_cbt( struct disk *disk )
+{
+	return disk->cbt;
+}
+
+struct qos *disk_qos( struct disk *disk )
 {
-	return nblocks;
+	return disk->qos;
 }
 
-static void sanity_check( int blocknum, const void *data )
+int disk_set_client( int client )
+{
+	return qos_set_client(client);
+}
+
+int disk_size( struct disk *disk )
+{
+	return disk->nblocks;
+}
+
+static void sanity_check( struct disk *disk, int blocknum, int count, const void *data )
 {
 	if(blocknum<0) {
 		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
 		abort();
 	}
 
-	if(blocknum>=nblocks) {
-		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
+	if(count<1 || blocknum+count>disk->nblocks) {
+		printf("ERROR: blocknum (%d) is too big!\n",blocknum+count-1);
 		abort();
 	}
 
@@ -50,16 +111,35 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
+void disk_read( struct disk *disk, int blocknum, char *data )
 {
-	int r;
-	sanity_check(blocknum,data);
+	disk_read_blocks(disk,blocknum,1,data);
+}
+
+void disk_write( struct disk *disk, int blocknum, const char *data )
+{
+	disk_write_blocks(disk,blocknum,1,data);
+}
+
+void disk_read_blocks( struct disk *disk, int blocknum, int count, char *data )
+{
+	disk_read_raw_blocks(disk,blocknum,count,data);
+	if(disk->encrypted) {
+		xts_decrypt(&disk->key,blocknum,(unsigned char *)data,DISK_BLOCK_SIZE,count);
+	}
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+void disk_read_raw_blocks( struct disk *disk, int blocknum, int count, char *data )
+{
+	ssize_t r;
+	size_t len = (size_t)count*DISK_BLOCK_SIZE;
+	sanity_check(disk,blocknum,count,data);
 
-	r = fread(data,DISK_BLOCK_SIZE,1,diskfile);
-	if(r==1) {
-		nreads++;
+	qos_begin(disk->qos,len);
+	r = pread(disk->fd,data,len,(off_t)blocknum*DISK_BLOCK_SIZE);
+	qos_end(disk->qos);
+	if(r==len) {
+		__atomic_fetch_add(&disk->nreads,count,__ATOMIC_RELAXED);
 	} else {
 		printf("ERROR: couldn't access simulated disk\n");
 		perror("disk_read");
@@ -67,16 +147,43 @@ void disk_read( int blocknum, char *data )
 	}
 }
 
-void disk_write( int blocknum, const char *data )
+/* Encrypted writes go through a pool buffer a chunk at a time, so the
+   caller's buffer is left untouched and the chunk stays in cache between
+   the cipher and the pwrite */
+static int write_encrypted( struct disk *disk, int blocknum, int count, const char *data )
 {
-	int r;
-	sanity_check(blocknum,data);
+	char *crypt_buf = bufpool_get(CRYPT_CHUNK_BLOCKS);
+	int done = 0;
+	while(done<count) {
+		int n = count-done;
+		size_t len;
+		if(n>CRYPT_CHUNK_BLOCKS) n = CRYPT_CHUNK_BLOCKS;
+		len = (size_t)n*DISK_BLOCK_SIZE;
+		memcpy(crypt_buf,data+(size_t)done*DISK_BLOCK_SIZE,len);
+		xts_encrypt(&disk->key,blocknum+done,(unsigned char *)crypt_buf,DISK_BLOCK_SIZE,n);
+		if(pwrite(disk->fd,crypt_buf,len,(off_t)(blocknum+done)*DISK_BLOCK_SIZE)!=len) break;
+		done += n;
+	}
+	bufpool_put(crypt_buf,CRYPT_CHUNK_BLOCKS);
+	return done;
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+static void write_blocks( struct disk *disk, int blocknum, int count, const char *data, int encrypt )
+{
+	int r;
+	size_t len = (size_t)count*DISK_BLOCK_SIZE;
+	sanity_check(disk,blocknum,count,data);
 
-	r = fwrite(data,DISK_BLOCK_SIZE,1,diskfile);
-	if(r==1) {
-		nwrites++;
+	qos_begin(disk->qos,len);
+	if(encrypt) {
+		r = write_encrypted(disk,blocknum,count,data);
+	} else {
+		r = (pwrite(disk->fd,data,len,(off_t)blocknum*DISK_BLOCK_SIZE)==len) ? count : 0;
+	}
+	qos_end(disk->qos);
+	if(r==count) {
+		__atomic_fetch_add(&disk->nwrites,count,__ATOMIC_RELAXED);
+		cbt_mark(disk->cbt,blocknum,count);
 	} else {
 		printf("ERROR: couldn't access simulated disk\n");
 		perror("disk write");
@@ -84,10 +191,68 @@ void disk_write( int blocknum, const char *data )
 	}
 }
 
-void disk_close()
+void disk_write_blocks( struct disk *disk, int blocknum, int count, const char *data )
 {
-	printf("%d disk block reads\n",nreads);
-	printf("%d disk block writes\n",nwrites);
-	fclose(diskfile);
+	write_blocks(disk,blocknum,count,data,disk->encrypted);
 }
 
+void disk_write_raw_blocks( struct disk *disk, int blocknum, int count, const char *data )
+{
+	write_blocks(disk,blocknum,count,data,0);
+}
+
+void disk_sync( struct disk *disk )
+{
+	long want;
+	int r = 0;
+
+	pthread_mutex_lock(&disk->sync_lock);
+	disk->nsync_requests++;
+	want = disk->syncs_started + 1;
+	while(disk->syncs_finished < want) {
+		if(disk->syncing) {
+			pthread_cond_wait(&disk->sync_cond,&disk->sync_lock);
+			continue;
+		}
+		disk->syncing = 1;
+		disk->syncs_started++;
+		pthread_mutex_unlock(&disk->sync_lock);
+		r = fdatasync(disk->fd);
+		pthread_mutex_lock(&disk->sync_lock);
+		disk->syncing = 0;
+		disk->syncs_finished = disk->syncs_started;
+		pthread_cond_broadcast(&disk->sync_cond);
+	}
+	pthread_mutex_unlock(&disk->sync_lock);
+
+	if(r<0) {
+		printf("ERROR: couldn't sync simulated disk\n");
+		perror("disk sync");
+		exit(1);
+	}
+}
+
+int disk_syncs( struct disk *disk )
+{
+	int n;
+	pthread_mutex_lock(&disk->sync_lock);
+	n = disk->syncs_finished;
+	pthread_mutex_unlock(&disk->sync_lock);
+	return n;
+}
+
+void disk_close( struct disk *disk )
+{
+	printf("%d disk block reads\n",disk->nreads);
+	printf("%d disk block writes\n",disk->nwrites);
+	if(disk->nsync_requests) {
+		printf("%ld disk syncs for %d requests\n",disk->syncs_finished,disk->nsync_requests);
+	}
+	cbt_close(disk->cbt);
+	qos_close(disk->qos);
+	close(disk->fd);
+	pthread_mutex_destroy(&disk->sync_lock);
+	pthread_cond_destroy(&disk->sync_cond);
+	memset(&disk->key,0,sizeof(disk->key));
+	free(disk);
+}
@@ -3,11 +3,41 @@
 
 #define DISK_BLOCK_SIZE 4096
 
-int  disk_init( const char *filename, int nblocks );
-int  disk_size();
-void disk_read( int blocknum, char *buffer );
-void disk_write( int blocknum, const char *buffer );
-void disk_close();
+/* An open disk image; every disk_* call takes the handle returned by
+   disk_init, so one process can drive any number of images */
+struct disk;
+
+struct disk *disk_init( const char *filename, int nblocks );
+int  disk_size( struct disk *disk );
+void disk_read( struct disk *disk, int blocknum, char *buffer );
+void disk_write( struct disk *disk, int blocknum, const char *buffer );
+void disk_read_blocks( struct disk *disk, int blocknum, int count, char *buffer );
+void disk_write_blocks( struct disk *disk, int blocknum, int count, const char *buffer );
+void disk_close( struct disk *disk );
+
+/* Makes every block written before the call durable. Callers that
+   overlap share one fdatasync: a caller arriving while one runs waits
+   for it and then joins the next */
+void disk_sync( struct disk *disk );
+int  disk_syncs( struct disk *disk );	/* fdatasync calls so far */
+
+/* At-rest encryption: XTS-AES-128 keyed by DISK_KEY_SIZE bytes and
+   tweaked by block number; must be set before the first read or write */
+#define DISK_KEY_SIZE 32
+int  disk_set_key( struct disk *disk, const unsigned char *key );
+const char *disk_cipher( struct disk *disk );
+
+/* Blocks as stored, ciphertext on an encrypted disk; the tweak is the
+   block number, so they read back the same on any image with the key */
+void disk_read_raw_blocks( struct disk *disk, int blocknum, int count, char *buffer );
+void disk_write_raw_blocks( struct disk *disk, int blocknum, int count, const char *buffer );
+
+/* Changed-block tracking and QoS state of the image, see cbt.h and qos.h */
+struct cbt *disk_cbt( struct disk *disk );
+struct qos *disk_qos( struct disk *disk );
+
+/* Requests from the calling thread are charged to client, see qos.h */
+int  disk_set_client( int client );
 
 
 #endif
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filemap.h"
+
+#define MIN_CAP 16
+
+struct filemap_cache {
+	int max_files;
+	int nfiles;
+	struct filemap **heads;	/* hash buckets, chained through hash_next */
+	int nheads;		/* power of two */
+	struct filemap *lru_head, *lru_tail;
+};
+
+struct filemap_cache *filemap_cache_init( int max_files )
+{
+	struct filemap_cache *cache = calloc(1, sizeof(struct filemap_cache));
+	cache->max_files = max_files;
+	cache->nheads = 1;
+	while(cache->nheads < 2 * max_files) cache->nheads *= 2;
+	cache->heads = calloc(cache->nheads, sizeof(struct filemap *));
+	return cache;
+}
+
+static struct filemap **bucket_of( struct filemap_cache *cache, int slot )
+{
+	return &cache->heads[((unsigned int)slot * 2654435761u) & (cache->nheads - 1)];
+}
+
+static void lru_unlink( struct filemap_cache *cache, struct filemap *map )
+{
+	if(map->prev) map->prev->next = map->next;
+	else cache->lru_head = map->next;
+	if(map->next) map->next->prev = map->prev;
+	else cache->lru_tail = map->prev;
+}
+
+static void lru_push( struct filemap_cache *cache, struct filemap *map )
+{
+	map->prev = NULL;
+	map->next = cache->lru_head;
+	if(cache->lru_head) cache->lru_head->prev = map;
+	else cache->lru_tail = map;
+	cache->lru_head = map;
+}
+
+static void release( struct filemap_cache *cache, struct filemap *map )
+{
+	struct filemap **link = bucket_of(cache, map->slot);
+	while(*link != map) link = &(*link)->hash_next;
+	*link = map->hash_next;
+	lru_unlink(cache, map);
+	cache->nfiles--;
+	pthread_rwlock_destroy(&map->lock);
+	free(map->blocks);
+	free(map);
+}
+
+void filemap_cache_destroy( struct filemap_cache *cache )
+{
+	if(!cache) return;
+	while(cache->lru_head) release(cache, cache->lru_head);
+	free(cache->heads);
+	free(cache);
+}
+
+struct filemap *filemap_lookup( struct filemap_cache *cache, int slot )
+{
+	struct filemap *map = *bucket_of(cache, slot);
+	while(map && map->slot != slot) map = map->hash_next;
+	if(map && cache->lru_head != map) {
+		lru_unlink(cache, map);
+		lru_push(cache, map);
+	}
+	return map;
+}
+
+struct filemap *filemap_insert( struct filemap_cache *cache, int slot )
+{
+	struct filemap *map;
+
+	if(cache->nfiles >= cache->max_files) {
+		/* maps of open files stay, the cache runs over instead */
+		map = cache->lru_tail;
+		while(map && map->refs > 0) map = map->prev;
+		if(map) release(cache, map);
+	}
+
+	map = calloc(1, sizeof(struct filemap));
+	map->slot = slot;
+	pthread_rwlock_init(&map->lock, NULL);
+	map->hash_next = *bucket_of(cache, slot);
+	*bucket_of(cache, slot) = map;
+	lru_push(cache, map);
+	cache->nfiles++;
+	return map;
+}
+
+void filemap_drop( struct filemap_cache *cache, int slot )
+{
+	struct filemap *map = *bucket_of(cache, slot);
+	while(map && map->slot != slot) map = map->hash_next;
+	if(map) release(cache, map);
+}
+
+void filemap_append( struct filemap *map, unsigned int block )
+{
+	if(map->nblocks == map->cap) {
+		map->cap = map->cap ? 2 * map->cap : MIN_CAP;
+		map->blocks = realloc(map->blocks, map->cap * sizeof(unsigned int));
+	}
+	map->blocks[map->nblocks++] = block;
+}
@@ -0,0 +1,47 @@
+#ifndef FILEMAP_H
+#define FILEMAP_H
+
+#include <pthread.h>
+
+/* Block maps of recently used files: blocks[i] is the disk block
+   holding the file's i-th block, so seeks and appends never walk the
+   fat chain. A bounded number of maps is kept, least recently used
+   ones are dropped. */
+
+struct filemap {
+	int slot;		/* directory slot of the file */
+	int nblocks;
+	int cap;
+	unsigned int *blocks;
+	int refs;		/* descriptors and calls using it, never dropped while nonzero */
+	char *dirty;		/* appends not yet on disk, owned by fs.c */
+	int dirty_len;
+	int dirty_cap;		/* bytes dirty can hold */
+	unsigned int length;	/* bytes on disk, as in the directory entry */
+	unsigned int version;	/* new whenever the map is built or the file written */
+
+	/* guards the fields above but refs, which belongs to the cache's owner */
+	pthread_rwlock_t lock;
+
+	struct filemap *prev, *next;	/* lru list */
+	struct filemap *hash_next;
+};
+
+struct filemap_cache;
+
+struct filemap_cache *filemap_cache_init( int max_files );
+void filemap_cache_destroy( struct filemap_cache *cache );
+
+/* The map of slot, or NULL when it is not cached */
+struct filemap *filemap_lookup( struct filemap_cache *cache, int slot );
+
+/* An empty map for slot, taking the place of the least recently used
+   one nobody holds */
+struct filemap *filemap_insert( struct filemap_cache *cache, int slot );
+
+/* Forgets the map of slot, for when its chain is freed */
+void filemap_drop( struct filemap_cache *cache, int slot );
+
+void filemap_append( struct filemap *map, unsigned int block );
+
+#endif
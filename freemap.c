@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "freemap.h"
+#include "bufpool.h"
+
+#define MAX_LEVELS 8
+#define WORD_BITS 64
+
+struct freemap {
+	int nblocks;
+	int nfree;
+	int nlevels;
+	int nwords[MAX_LEVELS];
+	uint64_t *level[MAX_LEVELS];
+};
+
+static long level_bytes( int nwords )
+{
+	return (long)nwords * sizeof(uint64_t);
+}
+
+/* A map of nblocks blocks, all of them in use */
+struct freemap *freemap_init( int nblocks )
+{
+	struct freemap *map = calloc(1, sizeof(struct freemap));
+	int bits = nblocks;
+
+	map->nblocks = nblocks;
+	do {
+		int words = (bits + WORD_BITS - 1) / WORD_BITS;
+		map->nwords[map->nlevels] = words;
+		map->level[map->nlevels] = bufpool_alloc(level_bytes(words));
+		map->nlevels++;
+		bits = words;
+	} while(bits > 1 && map->nlevels < MAX_LEVELS);
+
+	return map;
+}
+
+void freemap_destroy( struct freemap *map )
+{
+	int l;
+	if(!map) return;
+	for(l = 0; l < map->nlevels; l++) {
+		bufpool_free(map->level[l], level_bytes(map->nwords[l]));
+	}
+	free(map);
+}
+
+int freemap_is_free( struct freemap *map, int block )
+{
+	return (map->level[0][block / WORD_BITS] >> (block % WORD_BITS)) & 1;
+}
+
+void freemap_set_free( struct freemap *map, int block )
+{
+	int l, bit = block;
+
+	if(freemap_is_free(map, block)) return;
+	map->nfree++;
+
+	/* set the bit on every level until one already had a free bit */
+	for(l = 0; l < map->nlevels; l++) {
+		uint64_t *word = &map->level[l][bit / WORD_BITS];
+		int was_empty = (*word == 0);
+		*word |= (uint64_t)1 << (bit % WORD_BITS);
+		if(!was_empty) break;
+		bit /= WORD_BITS;
+	}
+}
+
+void freemap_set_used( struct freemap *map, int block )
+{
+	int l, bit = block;
+
+	if(!freemap_is_free(map, block)) return;
+	map->nfree--;
+
+	/* clear the bit on every level while words become empty */
+	for(l = 0; l < map->nlevels; l++) {
+		uint64_t *word = &map->level[l][bit / WORD_BITS];
+		*word &= ~((uint64_t)1 << (bit % WORD_BITS));
+		if(*word != 0) break;
+		bit /= WORD_BITS;
+	}
+}
+
+int freemap_count( struct freemap *map )
+{
+	return map->nfree;
+}
+
+/* Lowest set bit of level l at or after bit, -1 if none: climbs while the
+   rest of the current word is empty, then descends along first set bits */
+static int find_from( struct freemap *map, int l, int bit )
+{
+	while(1) {
+		int w = bit / WORD_BITS;
+		uint64_t word;
+
+		if(w >= map->nwords[l]) return -1;
+
+		word = map->level[l][w] & (~(uint64_t)0 << (bit % WORD_BITS));
+		if(word) {
+			bit = w * WORD_BITS + __builtin_ctzll(word);
+			break;
+		}
+
+		if(l + 1 >= map->nlevels) return -1;
+
+		/* nothing left in this word, find the next non-empty word */
+		bit = find_from(map, l + 1, w + 1);
+		if(bit < 0) return -1;
+		bit *= WORD_BITS;
+	}
+	return bit;
+}
+
+int freemap_find( struct freemap *map, int from )
+{
+	int block;
+
+	if(from < 0) from = 0;
+	if(from >= map->nblocks) return -1;
+
+	block = find_from(map, 0, from);
+	return (block >= 0 && block < map->nblocks) ? block : -1;
+}
+
+int freemap_run( struct freemap *map, int block, int max )
+{
+	int len = 0;
+
+	while(len < max && block + len < map->nblocks) {
+		int pos = block + len;
+		uint64_t word = map->level[0][pos / WORD_BITS] >> (pos % WORD_BITS);
+		int avail = WORD_BITS - pos % WORD_BITS;
+		int ones = (~word == 0) ? avail : __builtin_ctzll(~word);
+
+		if(ones > avail) ones = avail;
+		len += ones;
+		if(ones < avail) break;
+	}
+
+	if(len > max) len = max;
+	if(block + len > map->nblocks) len = map->nblocks - block;
+	return len;
+}
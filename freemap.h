@@ -0,0 +1,26 @@
+#ifndef FREEMAP_H
+#define FREEMAP_H
+
+/* Hierarchical bitmap of free blocks. Level 0 has a bit per block, each
+   level above has a bit per word of the level below that still has a
+   free block, so searches skip full regions a word at a time. */
+
+struct freemap;
+
+struct freemap *freemap_init( int nblocks );
+void freemap_destroy( struct freemap *map );
+
+void freemap_set_free( struct freemap *map, int block );
+void freemap_set_used( struct freemap *map, int block );
+int  freemap_is_free( struct freemap *map, int block );
+
+/* Number of free blocks */
+int  freemap_count( struct freemap *map );
+
+/* First free block at or after from, -1 if there is none */
+int  freemap_find( struct freemap *map, int from );
+
+/* Length of the free run starting at block, at most max */
+int  freemap_run( struct freemap *map, int block, int max );
+
+#endif
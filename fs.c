@@ -1,5 +1,11 @@
 #include "fs.h"
 #include "disk.h"
+#include "bufpool.h"
+#include "agroup.h"
+#include "dirindex.h"
+#include "bcache.h"
+#include "filemap.h"
+#include "freemap.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -8,6 +14,9 @@
 #include <math.h>
 #include <strings.h>
 #include <math.h>
+#include <time.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #define UNMOUNT_DISK_ERROR "Disc not mounted"
 #define DISK_ALREADY_MOUNTED_ERROR "Disk already mounted"
@@ -20,6 +29,14 @@
 #define INVALID_FILENAME "Name length to big"
 #define MISMATCH_MAGICNO "Magic number on disk does not match"
 #define MATCHING_MAGICNO "Magic number is valid"
+#define TOO_MANY_OPEN_FILES "Too many open files"
+#define BAD_DESCRIPTOR "Bad file descriptor"
+#define FILE_IS_OPEN "File is open"
+#define INVALID_OFFSET "Offset is negative"
+#define INVALID_LENGTH "Length is negative"
+#define INVALID_DURABILITY "Unknown durability mode"
+#define DEFRAG_NEEDS_JOURNAL "Defragmenting needs a journaled filesystem"
+#define CANT_CHECK_MOUNTED "Cannot check a mounted disk!"
 
 #define SUPERBLOCK_NUM 0
 #define DIRBLOCK_NUM 1
@@ -32,17 +49,24 @@
 #define TRUE 1
 
 //super block
-#define FS_MAGIC           0xf0f03410
+#define FAT_LAZY_REGIONS 4096	/* parts of the fat a format may leave unwritten */
+#define FS_MAGIC           0xf0f03413
+#define FS_MAGIC_V3        0xf0f03412	/* fat written whole at format, still mounted */
+#define FS_MAGIC_V2        0xf0f03411	/* no journal, still mounted */
+#define FS_MAGIC_V1        0xf0f03410	/* single block directory, still mounted */
 typedef struct{
 	int magic;
 	int nblocks;
 	int nfatblocks;
-	char filler[DISK_BLOCK_SIZE-3*sizeof(int)];
+	int journal_start;	/* right after the fat */
+	int journal_blocks;	/* 0 when the disk has no journal */
+	unsigned int clean_seq;	/* journal sequence at the last clean unmount, 0 while mounted */
+	int free_blocks;	/* free blocks at that unmount */
+	int fat_region_blocks;	/* fat blocks per bit of fat_lazy */
+	unsigned char fat_lazy[FAT_LAZY_REGIONS / 8];	/* fat regions never written, all free */
+	char filler[DISK_BLOCK_SIZE-8*sizeof(int)-FAT_LAZY_REGIONS/8];
 } super_block;
 
-super_block mb;
-int nblocks, nfatblocks;
-
 //directory
 #define MAX_NAME_LEN 6
 #define VALID 1
@@ -53,23 +77,254 @@ typedef struct{
 	unsigned int length;
 	unsigned int first_block;
 } dir_entry;
-#define N_DIR_ENTRIES (DISK_BLOCK_SIZE / sizeof(dir_entry))
-dir_entry dir[N_DIR_ENTRIES];
+#define N_DIR_ENTRIES (DISK_BLOCK_SIZE / sizeof(dir_entry))	/* per directory block */
+#define DIR_CACHE_BLOCKS 1024
+#define FILEMAP_CACHE_FILES 64	/* files whose block maps are kept */
+
+// delayed allocation: appends through descriptors are buffered and get
+// blocks only when the file is flushed
+#define DELAYED_FILE_MAX (4 << 20)	/* buffered bytes per file */
+#define DELAYED_TOTAL_MAX (64 << 20)	/* buffered bytes before everything is flushed */
+#define DIRTY_POOL_BUFFERS 16	/* freed append buffers kept for reuse */
+
+// open files
+#define MAX_OPEN_FILES 256
+typedef struct {
+	int used;
+	int slot;
+	struct filemap *map;	/* pinned while the file is open */
+	int pos;
+} open_file;
 
 // file allocation table
 #define N_ADDRESSES_PER_BLOCK (DISK_BLOCK_SIZE / sizeof(int))
+#define FAT_CACHE_BLOCKS 256	/* fat blocks kept in memory */
+#define FAT_INIT_BLOCKS 256	/* unwritten fat blocks written at once when first used */
 #define FREE 0
 #define BUSY 2
 #define EOFF 1
-unsigned int *fat = NULL;
+
+// metadata journal: fat and directory changes are logged as records and
+// committed in groups; the fat and directory blocks themselves are only
+// written at a checkpoint, when the log is half full
+#define JOURNAL_MAGIC 0x6a726e6c
+#define JOURNAL_MIN_BLOCKS 4
+#define JOURNAL_MAX_BLOCKS 1024
+#define JOURNAL_DISK_SHARE 64	/* one block of journal per this many on disk */
+#define JOURNAL_COMMIT_MS 5	/* longest a change waits for its commit */
+#define JOURNAL_COMMIT_RECORDS 4096	/* changes that commit without waiting */
+#define JOURNAL_SPLIT_SLACK 16	/* changes an operation makes between split points */
+#define SYNC_INTERVAL_MS 20	/* default for FS_DURABLE_PERIODIC */
+
+// defragmenter
+#define DEFRAG_CHUNK_BLOCKS 256	/* blocks copied per hold of a file's lock */
+
+// checker: each thread takes the next chunk of work until none is left
+#define FSCK_THREADS 8
+#define FSCK_FAT_CHUNK 64	/* fat blocks read per chunk */
+#define FSCK_SLOT_CHUNK 64	/* directory slots walked per chunk */
+#define FSCK_SCAN_CHUNK 65536	/* fat entries scanned for lost blocks per chunk */
+
+#define CHAIN_OK 0		/* ends in EOFF */
+#define CHAIN_BAD_LINK 1	/* links to a block that is not a data block */
+#define CHAIN_MEETS 2		/* links to a block of a lower slot or the directory */
+#define CHAIN_CYCLE 3		/* links back to a block of its own */
+
+// a block reached by several chains is owned by the lowest rank among them
+#define OWNER_DIR 1		/* directory blocks */
+#define owner_rank(slot) ((unsigned int) (slot) + 2)
+
+#define JR_FAT_CHAIN 1	/* entries index.. link to the next one, the last is set to value */
+#define JR_FAT_FREE 2	/* entries index.. are freed */
+#define JR_DIR 3	/* slot index holds entry */
+
+typedef struct {
+	unsigned int kind;
+	unsigned int index;
+	union {
+		struct {
+			unsigned int count;
+			unsigned int value;
+		} fat;
+		dir_entry entry;
+	} u;
+} journal_record;
+
+/* The first block of the journal; the log follows it */
+typedef struct {
+	unsigned int magic;
+	unsigned int seq;	/* transaction expected in the first log block */
+} journal_header;
+
+/* Every log block; a transaction is a run of blocks with the same
+   sequence number, the last one marked commit */
+typedef struct {
+	unsigned int magic;
+	unsigned int seq;
+	unsigned int checksum;	/* of the block with this field zero */
+	int nrecords;
+	int commit;
+} journal_block;
+#define JOURNAL_RECORDS_PER_BLOCK ((DISK_BLOCK_SIZE - sizeof(journal_block)) / sizeof(journal_record))
+
+/* What read_journal found: fat records go to fat, or the cached fat
+   when NULL, directory records are kept */
+typedef struct {
+	struct fs *fs;
+	unsigned int *fat;
+	journal_record *dir_records;
+	int ndir;
+	int dir_cap;
+} journal_replay;
+
+/* How far the chain of one file checks out */
+typedef struct {
+	int nblocks;		/* blocks before anything went wrong */
+	unsigned int last;	/* the last of them, EOFF for none */
+	int end;
+	unsigned int met;	/* the block a CHAIN_MEETS or CHAIN_CYCLE chain links to */
+} chain_check;
+
+/* State of fs_check, shared by its threads */
+struct fsck {
+	struct fs *fs;
+	unsigned int *fat;		/* the whole fat, read from disk */
+	unsigned int *owner;		/* rank of the owner per block, 0 for none */
+	unsigned long *reached;		/* a bit per block a chain kept */
+	unsigned int data_start;	/* first block after the metadata */
+	dir_entry *entries;
+	chain_check *chains;
+	int nslots;
+	int leaked;
+
+	void (*work)(struct fsck *check, int item);
+	int nitems;
+	int next;			/* next item to take */
+};
+
+/* A filesystem on one disk; all state lives here so any number of them
+   can be mounted side by side */
+struct fs {
+	/* locks, always taken in this order:
+	   dir_lock    file names: the name index and the free slots; shared
+	               by every call that finds a file by name, exclusive
+	               for create and delete, untouched by descriptor calls
+	   map->lock   one file: its block map, buffered appends and length
+	   files_lock  descriptors, the filemap cache and map refs
+	   meta_lock   fat, directory blocks and the journal
+	   the allocation groups' own locks come last, see agroup.h; blocks
+	   are found under them alone and linked in under meta_lock;
+	   defrag_lock is taken alone */
+	pthread_rwlock_t dir_lock;
+	pthread_mutex_t files_lock;
+	pthread_mutex_t meta_lock;
+	pthread_cond_t map_released;	/* some map's refs dropped to zero */
+
+	struct disk *disk;
+	super_block mb;
+	int nblocks, nfatblocks;
+
+	/* the fat is paged in through a cache of its blocks, the one last
+	   used is fat_page */
+	struct bcache *fatcache;
+	int fat_page;
+	unsigned int *fat_page_data;
+
+	/* the directory is a chain of blocks from DIRBLOCK_NUM, slot s is
+	   entry s % N_DIR_ENTRIES of block s / N_DIR_ENTRIES */
+	struct bcache *dircache;
+	int *dir_blocks;
+	int ndir_blocks, dir_blocks_cap;
+	int upgrade_superblock;
+
+	/* name index and unused slots of the directory, built at mount */
+	struct dirindex *dirindex;
+	int *free_slots;
+	int nfree_slots;
+
+	/* block maps of recently used files */
+	struct filemap_cache *filemaps;
+
+	/* descriptors handed out by fs_open */
+	open_file files[MAX_OPEN_FILES];
+
+	/* appended data buffered by open files, and the blocks it will need */
+	long delayed_bytes;
+	int delayed_blocks;
+
+	/* append buffers of maps that no longer hold data, under files_lock */
+	char *dirty_pool[DIRTY_POOL_BUFFERS];
+	int dirty_pool_cap[DIRTY_POOL_BUFFERS];
+	int ndirty_pool;
+
+	/* free fat entries and the blocks reserved for appending files,
+	   split into allocation groups, built at mount */
+	struct agroups *groups;
+
+	/* journal: the running transaction is the fat entries and directory
+	   entries changed since the last commit; blocks it freed are kept
+	   out of the freemap until it commits so nothing overwrites them */
+	int journal_active;
+	int journal_next;		/* next log block to write */
+	unsigned int journal_seq;	/* sequence of the running transaction */
+	int commit_records;		/* changes that, with the slack, fit half the log */
+	long long tx_start_ms;		/* first change of the running transaction */
+	journal_record *fat_log;
+	int nfat_log, fat_log_cap;
+	journal_record *dir_log;
+	int ndir_log, dir_log_cap;
+	int *pending_free;
+	int npending_free, pending_free_cap;
+	journal_record *records;
+	int records_cap;
+
+	/* durability policy, see fs.h */
+	int durability;
+	int sync_interval_ms;
+	long long last_sync_ms;
+	int unsynced_data;		/* file blocks written since the last sync */
+	int unsynced_journal;		/* transactions written since the last sync, under meta_lock */
+
+	unsigned int map_versions;	/* hands out filemap versions */
+
+	/* online defragmenter, guarded by defrag_lock */
+	pthread_mutex_t defrag_lock;
+	pthread_cond_t defrag_cond;	/* wakes the thread to stop */
+	pthread_t defrag_thread;
+	int defrag_joinable;
+	int defrag_stop;
+	int defrag_rate;		/* blocks per second, 0 for no limit */
+	double defrag_due_ms;		/* when the budget allows more copying */
+	fs_defrag_stats defrag_stats;
+};
 
 #define maximum_value(x, y) (((x) > (y)) ? (x) : (y))
 #define minimum_value(x, y) (((x) < (y)) ? (x) : (y))
 #define up_rounded_division(x, y) ((x+y-1)/y)
 
+/* Creates an unmounted filesystem handle for disk */
+struct fs *fs_init(struct disk *disk) {
+	struct fs *fs = (struct fs *) calloc(1, sizeof(struct fs));
+	fs->disk = disk;
+	pthread_rwlock_init(&fs->dir_lock, NULL);
+	pthread_mutex_init(&fs->files_lock, NULL);
+	pthread_mutex_init(&fs->meta_lock, NULL);
+	pthread_cond_init(&fs->map_released, NULL);
+	pthread_mutex_init(&fs->defrag_lock, NULL);
+	pthread_cond_init(&fs->defrag_cond, NULL);
+	fs->durability = FS_DURABLE_BARRIER;
+	fs->sync_interval_ms = SYNC_INTERVAL_MS;
+	return fs;
+}
+
+/* Checks if magic is one this code can mount */
+int is_magic_valid(int magic) {
+	return magic == FS_MAGIC || magic == FS_MAGIC_V3 || magic == FS_MAGIC_V2 || magic == FS_MAGIC_V1;
+}
+
 /* Checks if the disk is mounted */
-int is_mounted() {
-	if(mb.magic == FS_MAGIC){
+int is_mounted(struct fs *fs) {
+	if(fs->mb.magic == FS_MAGIC){
 		return 1;
 	}
 	return 0;
@@ -84,230 +339,987 @@ int is_name_valid(char* string) {
 	return 0;
 }
 
-/* Writes fat to disk */
-void write_fat_to_disk() {
-	int i;
-	for (i = 0; i < nfatblocks; i++) {
-		disk_write(2 + i, &((char *)fat)[i * DISK_BLOCK_SIZE]);
+/* Checks if fat block b lies in a region the format left unwritten,
+   whose entries are all free */
+int is_fat_lazy(struct fs *fs, int b) {
+	if (fs->mb.fat_region_blocks == 0) {
+		return FALSE;
 	}
+	int region = b / fs->mb.fat_region_blocks;
+	return (__atomic_load_n(&fs->mb.fat_lazy[region / 8], __ATOMIC_ACQUIRE) >> (region % 8)) & 1;
 }
 
 /* Writes the superblock to the disk */
-void write_superblock_to_disk() {
-	disk_write(SUPERBLOCK_NUM, (char *)&mb);
+void write_superblock_to_disk(struct fs *fs) {
+	disk_write(fs->disk, SUPERBLOCK_NUM, (char *)&fs->mb);
 }
 
-/* Writes the directory block to the disk */
-void write_dir_to_disk() {
-	disk_write(DIRBLOCK_NUM, (char *)&dir);
+/* Writes the unwritten fat regions from the one holding fat block b on,
+   up to FAT_INIT_BLOCKS blocks of them, as free. The zeroes are
+   durable before the superblock stops counting them unwritten, and it
+   is before any entry of theirs can change on disk. The caller holds
+   meta_lock once the disk is mounted */
+void init_fat_regions(struct fs *fs, int b) {
+	int region_blocks = fs->mb.fat_region_blocks;
+	int from = b / region_blocks * region_blocks, end = from, r;
+	while (end < fs->nfatblocks && end - from < FAT_INIT_BLOCKS && is_fat_lazy(fs, end)) {
+		end = minimum_value(end + region_blocks, fs->nfatblocks);
+	}
+
+	char *zeroes = bufpool_get(BUFPOOL_MAX_BLOCKS);
+	memset(zeroes, 0, BUFPOOL_MAX_BLOCKS * DISK_BLOCK_SIZE);
+	for (b = from; b < end; b += BUFPOOL_MAX_BLOCKS) {
+		disk_write_blocks(fs->disk, 2 + b, minimum_value(end - b, BUFPOOL_MAX_BLOCKS), zeroes);
+	}
+	bufpool_put(zeroes, BUFPOOL_MAX_BLOCKS);
+
+	if (fs->durability != FS_DURABLE_NONE) {
+		disk_sync(fs->disk);
+	}
+	for (r = from / region_blocks; r <= (end - 1) / region_blocks; r++) {
+		__atomic_and_fetch(&fs->mb.fat_lazy[r / 8], (unsigned char) ~(1 << (r % 8)), __ATOMIC_RELEASE);
+	}
+	write_superblock_to_disk(fs);
+	if (fs->durability != FS_DURABLE_NONE) {
+		disk_sync(fs->disk);
+	}
 }
 
-/* Reads the superblock from the disk */
-void read_superblock_from_disk() {
-	disk_read(SUPERBLOCK_NUM, (char*)&mb);
+/* Returns fat entry index in its cached block, read from disk on a
+   miss; the pointer stays valid until another fat block is used. The
+   caller holds meta_lock once the disk is mounted */
+unsigned int *fat_entry(struct fs *fs, int index) {
+	int page = index / N_ADDRESSES_PER_BLOCK;
+	if (page != fs->fat_page) {
+		if (is_fat_lazy(fs, page)) {
+			init_fat_regions(fs, page);
+		}
+		fs->fat_page_data = (unsigned int *) bcache_get(fs->fatcache, 2 + page);
+		fs->fat_page = page;
+	}
+	return &fs->fat_page_data[index % N_ADDRESSES_PER_BLOCK];
 }
 
-/* Reads the directory from the disk */
-void read_dir_from_disk() {
-	disk_read(DIRBLOCK_NUM, (char*)dir);
+/* Returns fat entry index */
+unsigned int fat_get(struct fs *fs, int index) {
+	return *fat_entry(fs, index);
 }
 
-/* Reads the fat from the disk */
-void read_fat_from_disk() {
-	if (fat == NULL) {
-		fat = (unsigned int *) malloc(nfatblocks * DISK_BLOCK_SIZE);
+/* Makes room for need elements of size bytes in a growable array */
+void *grow_array(void *array, int *cap, int need, size_t size) {
+	if (need > *cap) {
+		*cap = maximum_value(need, 2 * *cap + 16);
+		array = realloc(array, (size_t) *cap * size);
 	}
-	int i;
-	for(i = 0; i < nfatblocks; i++) {
-		disk_read(2 + i, ((char *)fat) + i * DISK_BLOCK_SIZE);
-		//disk_read(2 + i, (char*)(fat + i * DISK_BLOCK_SIZE));
+	return array;
+}
+
+/* Milliseconds on a clock that only moves forward */
+long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Starts the commit clock with the first change of a transaction */
+void start_transaction(struct fs *fs) {
+	if (fs->nfat_log == 0 && fs->ndir_log == 0) {
+		fs->tx_start_ms = now_ms();
+	}
+}
+
+/* Adds the change of fat entry index to value to the running
+   transaction; the value is kept so a commit reads no fat blocks */
+void log_fat(struct fs *fs, int index, unsigned int value) {
+	start_transaction(fs);
+	fs->fat_log = grow_array(fs->fat_log, &fs->fat_log_cap, fs->nfat_log + 1, sizeof(journal_record));
+	journal_record *record = &fs->fat_log[fs->nfat_log];
+	record->kind = fs->nfat_log++;	/* order of the change until collected */
+	record->index = index;
+	record->u.fat.value = value;
+}
+
+/* Sets a fat entry, keeping the free space index in step */
+void fat_set(struct fs *fs, int index, unsigned int value) {
+	unsigned int *entry = fat_entry(fs, index);
+	if (*entry == value) {
+		return;
+	}
+	if (fs->groups != NULL) {
+		if (value == FREE && fs->journal_active) {
+			agroups_load(fs->groups, index);
+			fs->pending_free = grow_array(fs->pending_free, &fs->pending_free_cap, fs->npending_free + 1, sizeof(int));
+			fs->pending_free[fs->npending_free++] = index;
+		} else if (value == FREE) {
+			agroups_set_free(fs->groups, index);
+		} else if (*entry == FREE) {
+			agroups_set_used(fs->groups, index);
+		}
+	}
+	*entry = value;
+	bcache_mark(fs->fatcache, entry);
+	if (fs->journal_active) {
+		log_fat(fs, index, value);
+	}
+}
+
+/* Marks the directory entry in slot as changed; call it after the change */
+void mark_dir_entry(struct fs *fs, int slot, dir_entry *entry) {
+	bcache_mark(fs->dircache, entry);
+	if (fs->journal_active) {
+		start_transaction(fs);
+		fs->dir_log = grow_array(fs->dir_log, &fs->dir_log_cap, fs->ndir_log + 1, sizeof(journal_record));
+		journal_record *record = &fs->dir_log[fs->ndir_log];
+		record->kind = fs->ndir_log++;	/* order of the change until collected */
+		record->index = slot;
+		record->u.entry = *entry;
+	}
+}
+
+/* Writes the changed fat blocks to disk, adjacent ones in one request */
+void write_fat_to_disk(struct fs *fs) {
+	bcache_flush(fs->fatcache);
+}
+
+/* Writes the changed directory blocks to the disk */
+void write_dir_to_disk(struct fs *fs) {
+	bcache_flush(fs->dircache);
+}
+
+/* Reads the superblock from the disk */
+void read_superblock_from_disk(struct fs *fs) {
+	disk_read(fs->disk, SUPERBLOCK_NUM, (char*)&fs->mb);
+	if (fs->mb.magic == FS_MAGIC_V2 || fs->mb.magic == FS_MAGIC_V1) {
+		/* no journal on these, the fields may hold anything */
+		fs->mb.journal_start = 0;
+		fs->mb.journal_blocks = 0;
+	}
+	if (fs->mb.magic != FS_MAGIC) {
+		/* nor the fields after it on any of these */
+		fs->mb.clean_seq = 0;
+		fs->mb.free_blocks = 0;
+		fs->mb.fat_region_blocks = 0;
+		memset(fs->mb.fat_lazy, 0, sizeof(fs->mb.fat_lazy));
 	}
 }
 
-/* Returns a pointer to the entry in the dir table that matches with given
-   file name, if there is no file with such name returns NULL */
-dir_entry * get_dir_entry(char * file_name) {
+/* FNV-1a of a log block, taken with its checksum field zero */
+unsigned int journal_checksum(char *block) {
+	journal_block *header = (journal_block *) block;
+	unsigned int saved = header->checksum, hash = 2166136261u;
 	int i;
-	for(i = 0; i < N_DIR_ENTRIES; i++) {
-		dir_entry * entry = &(dir[i]);
-		if((strcmp(entry->name, file_name) == 0) && (entry->used)) {
-			return entry;
+	header->checksum = 0;
+	for (i = 0; i < DISK_BLOCK_SIZE; i++) {
+		hash = (hash ^ (unsigned char) block[i]) * 16777619u;
+	}
+	header->checksum = saved;
+	return hash;
+}
+
+/* Writes the journal header: the log now starts empty at transaction seq */
+void write_journal_header(struct fs *fs) {
+	char *block = bufpool_get(1);
+	memset(block, 0, DISK_BLOCK_SIZE);
+	journal_header *header = (journal_header *) block;
+	header->magic = JOURNAL_MAGIC;
+	header->seq = fs->journal_seq;
+	disk_write(fs->disk, fs->mb.journal_start, block);
+	bufpool_put(block, 1);
+	fs->journal_next = fs->mb.journal_start + 1;
+}
+
+/* Writes the fat and directory blocks changed since the last checkpoint
+   in place and empties the log. Everything in memory must be committed,
+   or be meant to go out without a journal. Unless durability is off the
+   log is durable before the blocks are overwritten, and they are before
+   the log is emptied */
+void checkpoint(struct fs *fs) {
+	int ordered = (fs->durability != FS_DURABLE_NONE);
+	if (ordered) {
+		disk_sync(fs->disk);
+		fs->unsynced_journal = FALSE;
+	}
+	write_fat_to_disk(fs);
+	write_dir_to_disk(fs);
+	if (ordered) {
+		disk_sync(fs->disk);
+	}
+	write_journal_header(fs);
+}
+
+int by_index(const void *a, const void *b) {
+	const journal_record *x = a, *y = b;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+int by_slot_then_order(const void *a, const void *b) {
+	const journal_record *x = a, *y = b;
+	if (x->index != y->index) {
+		return (x->index > y->index) - (x->index < y->index);
+	}
+	return (x->kind > y->kind) - (x->kind < y->kind);
+}
+
+/* Turns the running transaction into records in fs->records: runs of
+   adjacent fat entries that are freed or chained in order take one
+   record, and an entry or slot changed several times keeps its last
+   value. The fat log is left sorted by index with one change per entry.
+   Returns the number of records */
+int collect_records(struct fs *fs) {
+	int n = 0, i;
+	journal_record *log = fs->fat_log;
+	fs->records = grow_array(fs->records, &fs->records_cap, fs->nfat_log + fs->ndir_log, sizeof(journal_record));
+
+	qsort(log, fs->nfat_log, sizeof(journal_record), by_slot_then_order);
+	int nfat = 0;
+	for (i = 0; i < fs->nfat_log; i++) {
+		if (nfat > 0 && log[nfat - 1].index == log[i].index) {
+			nfat--;
 		}
+		log[nfat++] = log[i];
 	}
-	return NULL;
+	fs->nfat_log = nfat;
+
+	i = 0;
+	while (i < nfat) {
+		unsigned int index = log[i].index;
+		journal_record *record = &fs->records[n++];
+		int count = 1;
+		memset(record, 0, sizeof(journal_record));
+		record->index = index;
+		if (log[i].u.fat.value == FREE) {
+			while (i + count < nfat && log[i + count].index == index + count &&
+			       log[i + count].u.fat.value == FREE) {
+				count++;
+			}
+			record->kind = JR_FAT_FREE;
+		} else {
+			while (i + count < nfat && log[i + count].index == index + count &&
+			       log[i + count - 1].u.fat.value == index + count) {
+				count++;
+			}
+			record->kind = JR_FAT_CHAIN;
+		}
+		record->u.fat.count = count;
+		record->u.fat.value = log[i + count - 1].u.fat.value;
+		i += count;
+	}
+
+	qsort(fs->dir_log, fs->ndir_log, sizeof(journal_record), by_slot_then_order);
+	for (i = 0; i < fs->ndir_log; i++) {
+		if (i + 1 < fs->ndir_log && fs->dir_log[i + 1].index == fs->dir_log[i].index) {
+			continue;
+		}
+		fs->records[n] = fs->dir_log[i];
+		fs->records[n++].kind = JR_DIR;
+	}
+	return n;
+}
+
+/* Appends the first n records of fs->records to the log as one
+   transaction, the caller has checked they fit */
+void write_transaction(struct fs *fs, int n) {
+	char *buf = bufpool_get(BUFPOOL_MAX_BLOCKS);
+	int nblocks = up_rounded_division(n, (int) JOURNAL_RECORDS_PER_BLOCK);
+	int b = 0, done = 0;
+	while (b < nblocks) {
+		int run = minimum_value(nblocks - b, BUFPOOL_MAX_BLOCKS), i;
+		memset(buf, 0, run * DISK_BLOCK_SIZE);
+		for (i = 0; i < run; i++) {
+			char *block = buf + i * DISK_BLOCK_SIZE;
+			journal_block *header = (journal_block *) block;
+			header->magic = JOURNAL_MAGIC;
+			header->seq = fs->journal_seq;
+			header->nrecords = minimum_value(n - done, (int) JOURNAL_RECORDS_PER_BLOCK);
+			header->commit = (b + i == nblocks - 1);
+			memcpy(block + sizeof(journal_block), &fs->records[done], header->nrecords * sizeof(journal_record));
+			header->checksum = journal_checksum(block);
+			done += header->nrecords;
+		}
+		disk_write_blocks(fs->disk, fs->journal_next, run, buf);
+		fs->journal_next += run;
+		b += run;
+	}
+	bufpool_put(buf, BUFPOOL_MAX_BLOCKS);
+	fs->journal_seq++;
+	fs->unsynced_journal = TRUE;
 }
 
-/* Returns a pointer an empty entry in the dir table, if there
-  is none returns null */
-dir_entry *get_empty_dir_entry() {
+/* Commits the running transaction. Its blocks land in place at the next
+   checkpoint, which comes once the log is half full so the following
+   transaction finds room */
+void journal_commit(struct fs *fs) {
+	if (!fs->journal_active || (fs->nfat_log == 0 && fs->ndir_log == 0)) {
+		return;
+	}
+	int n = collect_records(fs);
+	int nblocks = up_rounded_division(n, (int) JOURNAL_RECORDS_PER_BLOCK);
+	int end = fs->mb.journal_start + fs->mb.journal_blocks;
+
+	if (fs->journal_next + nblocks > end) {
+		/* only if an operation ran past the slack between its split
+		   points: it goes in place, without atomicity */
+		checkpoint(fs);
+	} else {
+		write_transaction(fs, n);
+		if (end - fs->journal_next < (fs->mb.journal_blocks - 1) / 2) {
+			checkpoint(fs);
+		}
+	}
+
+	/* the deletes are on disk, their blocks can be reused unless
+	   linked again since */
 	int i;
-	for(i = 0; i < N_DIR_ENTRIES; i++) {
-		dir_entry *entry = &(dir[i]);
-		if(entry->used == FALSE) {
-			return entry;
+	for (i = 0; i < fs->npending_free; i++) {
+		journal_record key, *change;
+		key.index = fs->pending_free[i];
+		change = bsearch(&key, fs->fat_log, fs->nfat_log, sizeof(journal_record), by_index);
+		if (change != NULL && change->u.fat.value == FREE) {
+			agroups_set_free(fs->groups, fs->pending_free[i]);
 		}
 	}
-	return NULL;
+	fs->npending_free = 0;
+	fs->nfat_log = 0;
+	fs->ndir_log = 0;
+}
+
+/* Commits the running transaction. Unless durability is off this is a
+   sync point: the data the transaction points to is made durable
+   before the commit, and the commit after it. Data is written without
+   meta_lock, so the flag is cleared before the sync that covers it */
+void commit_group(struct fs *fs) {
+	if (fs->durability == FS_DURABLE_NONE) {
+		journal_commit(fs);
+		return;
+	}
+	if (__atomic_load_n(&fs->unsynced_data, __ATOMIC_ACQUIRE) && fs->journal_active && (fs->nfat_log > 0 || fs->ndir_log > 0)) {
+		disk_sync(fs->disk);
+	}
+	journal_commit(fs);
+	__atomic_store_n(&fs->unsynced_data, FALSE, __ATOMIC_SEQ_CST);
+	disk_sync(fs->disk);
+	fs->unsynced_journal = FALSE;
+	fs->last_sync_ms = now_ms();
+}
+
+/* Called at points inside an operation where the disk would be
+   consistent: commits what it changed so far once the transaction is
+   as big as commit_records, so none outgrows the log. The data the
+   commit points to is made durable first unless durability is off */
+void journal_split(struct fs *fs) {
+	if (!fs->journal_active || fs->nfat_log + fs->ndir_log < fs->commit_records) {
+		return;
+	}
+	if (fs->durability != FS_DURABLE_NONE && __atomic_load_n(&fs->unsynced_data, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&fs->unsynced_data, FALSE, __ATOMIC_SEQ_CST);
+		disk_sync(fs->disk);
+	}
+	journal_commit(fs);
+}
+
+/* Ends an operation that changed the disk. Without a journal its
+   metadata is written in place now. It is synced when the durability
+   mode asks for it; otherwise its changes are committed, without a
+   sync, together with those of the operations that follow within
+   JOURNAL_COMMIT_MS */
+void commit_metadata(struct fs *fs) {
+	int pending = fs->nfat_log + fs->ndir_log;
+	if (!fs->journal_active) {
+		write_dir_to_disk(fs);
+		write_fat_to_disk(fs);
+	}
+	if (pending == 0 && !__atomic_load_n(&fs->unsynced_data, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	if (fs->durability == FS_DURABLE_OP ||
+	    (fs->durability == FS_DURABLE_PERIODIC && now_ms() - fs->last_sync_ms >= fs->sync_interval_ms)) {
+		commit_group(fs);
+	} else if (pending > 0 && (pending >= fs->commit_records || now_ms() - fs->tx_start_ms >= JOURNAL_COMMIT_MS)) {
+		journal_commit(fs);
+	}
+}
+
+/* A changed directory or fat block is about to be written in place by
+   its cache, which is only safe once its changes are committed and,
+   unless durability is off, the commit is durable */
+void journal_writeback_hook(void *arg) {
+	struct fs *fs = arg;
+	journal_commit(fs);
+	if (fs->durability != FS_DURABLE_NONE && fs->unsynced_journal) {
+		disk_sync(fs->disk);
+		fs->unsynced_journal = FALSE;
+	}
+}
+
+/* Records a clean unmount: the fat is on disk and the free block count
+   stored with it, so the next mount need not read the fat. Anything
+   the journal commits after it makes the count stale */
+void write_clean_superblock(struct fs *fs) {
+	fs->mb.free_blocks = agroups_free(fs->groups) + fs->npending_free;
+	fs->mb.clean_seq = fs->journal_seq;
+	disk_sync(fs->disk);
+	write_superblock_to_disk(fs);
+	disk_sync(fs->disk);
+}
+
+/* Leaves everything the mounted filesystem holds on disk in place */
+void write_back(struct fs *fs) {
+	fs_sync(fs);
+	if (fs->journal_active) {
+		checkpoint(fs);
+		write_clean_superblock(fs);
+	}
 }
 
-/* Returns an empty fat entry */
-unsigned int * get_empty_fat_entry(int * starting_index) {
+/* Releases the filesystem handle, the disk stays open */
+void fs_destroy(struct fs *fs) {
+	fs_defrag_stop(fs);
+	if (is_mounted(fs)) {
+		write_back(fs);
+	}
+	bcache_destroy(fs->fatcache);
+	agroups_destroy(fs->groups);
+	dirindex_destroy(fs->dirindex);
+	bcache_destroy(fs->dircache);
+	filemap_cache_destroy(fs->filemaps);
+	while (fs->ndirty_pool > 0) {
+		fs->ndirty_pool--;
+		bufpool_free(fs->dirty_pool[fs->ndirty_pool], fs->dirty_pool_cap[fs->ndirty_pool]);
+	}
+	free(fs->dir_blocks);
+	free(fs->free_slots);
+	free(fs->fat_log);
+	free(fs->dir_log);
+	free(fs->pending_free);
+	free(fs->records);
+	pthread_rwlock_destroy(&fs->dir_lock);
+	pthread_mutex_destroy(&fs->files_lock);
+	pthread_mutex_destroy(&fs->meta_lock);
+	pthread_cond_destroy(&fs->map_released);
+	pthread_mutex_destroy(&fs->defrag_lock);
+	pthread_cond_destroy(&fs->defrag_cond);
+	free(fs);
+}
+
+
+/* Appends block to the directory, its slots go on the free slot stack
+   lowest on top */
+void add_dir_block(struct fs *fs, int block) {
+	if (fs->ndir_blocks == fs->dir_blocks_cap) {
+		fs->dir_blocks_cap = maximum_value(16, 2 * fs->dir_blocks_cap);
+		fs->dir_blocks = realloc(fs->dir_blocks, fs->dir_blocks_cap * sizeof(int));
+		fs->free_slots = realloc(fs->free_slots, fs->dir_blocks_cap * N_DIR_ENTRIES * sizeof(int));
+	}
+	int first_slot = fs->ndir_blocks * N_DIR_ENTRIES;
+	fs->dir_blocks[fs->ndir_blocks++] = block;
+
 	int i;
-	for(i = *starting_index; i < nblocks; i++) {
-		unsigned int * entry = &(fat[i]);
-		if(*entry == FREE) {
-			* starting_index = i;
-			return entry;
+	for (i = N_DIR_ENTRIES - 1; i >= 0; i--) {
+		fs->free_slots[fs->nfree_slots++] = first_slot + i;
+	}
+}
+
+/* Checks if block lies past the metadata, where file and directory
+   blocks go */
+int is_data_block(struct fs *fs, unsigned int block) {
+	return block >= 2 + fs->nfatblocks + fs->mb.journal_blocks && block < fs->nblocks;
+}
+
+/* Finds the directory blocks by following their chain in fat, or the
+   cached fat when NULL. A chain that leaves the data blocks ends there,
+   one that meets itself, which shows as a block equal to the one half
+   as far along, where it first repeats; fs_check repairs both */
+void find_dir_blocks(struct fs *fs, const unsigned int *fat) {
+	unsigned int block = DIRBLOCK_NUM;
+	fs->ndir_blocks = 0;
+	fs->nfree_slots = 0;
+	do {
+		add_dir_block(fs, block);
+		block = (fat != NULL) ? fat[block] : fat_get(fs, block);
+	} while (is_data_block(fs, block) && block != fs->dir_blocks[fs->ndir_blocks / 2]);
+
+	if (is_data_block(fs, block)) {
+		int i, j;
+		for (j = 1; j < fs->ndir_blocks; j++) {
+			for (i = 0; i < j && fs->dir_blocks[i] != fs->dir_blocks[j]; i++);
+			if (i < j) {
+				break;
+			}
 		}
+		fs->ndir_blocks = j;
+	}
+}
+
+/* Drops the cached directory and finds its blocks in the fat */
+void read_dir_from_disk(struct fs *fs) {
+	bcache_destroy(fs->dircache);
+	fs->dircache = bcache_init(fs->disk, DIR_CACHE_BLOCKS);
+	find_dir_blocks(fs, NULL);
+}
+
+/* Returns the directory entry in slot */
+dir_entry *dir_entry_at(struct fs *fs, int slot) {
+	dir_entry *entries = (dir_entry *) bcache_get(fs->dircache, fs->dir_blocks[slot / N_DIR_ENTRIES]);
+	return &entries[slot % N_DIR_ENTRIES];
+}
+
+/* Sets the link after block last in the chain of the file in slot:
+   the fat entry of last, or the file's first_block when last is EOFF */
+void set_link(struct fs *fs, int slot, unsigned int last, unsigned int value) {
+	if (last != EOFF) {
+		fat_set(fs, last, value);
+		return;
+	}
+	dir_entry *entry = dir_entry_at(fs, slot);
+	if (entry->first_block != value) {
+		entry->first_block = value;
+		mark_dir_entry(fs, slot, entry);
+	}
+}
+
+/* Drops the cached fat, its blocks are read from the disk as they are
+   used */
+void read_fat_from_disk(struct fs *fs) {
+	bcache_destroy(fs->fatcache);
+	fs->fatcache = bcache_init(fs->disk, FAT_CACHE_BLOCKS);
+	fs->fat_page = -1;
+}
+
+/* Links a new block to the end of the directory chain */
+int grow_directory(struct fs *fs) {
+	int last = fs->dir_blocks[fs->ndir_blocks - 1];
+	int run;
+	int block = agroups_alloc(fs->groups, -1, last + 1, 1, &run);
+	if (block < 0 && agroups_reserved(fs->groups) > 0) {
+		agroups_release_all(fs->groups);
+		block = agroups_alloc(fs->groups, -1, last + 1, 1, &run);
+	}
+	if (block < 0 && fs->npending_free > 0) {
+		journal_commit(fs);
+		block = agroups_alloc(fs->groups, -1, last + 1, 1, &run);
+	}
+	if (block < 0) {
+		return -1;
+	}
+
+	/* zeroed in place before the link to it commits, the journal
+	   only carries the entries that get used */
+	disk_write(fs->disk, block, bcache_new(fs->dircache, block));
+	fat_set(fs, block, EOFF);
+	fat_set(fs, last, block);
+	add_dir_block(fs, block);
+
+	if (fs->upgrade_superblock) {
+		write_superblock_to_disk(fs);
+		fs->upgrade_superblock = FALSE;
+	}
+	return 0;
+}
+
+/* Returns a pointer an empty entry in the dir table and its slot in
+   *slot, growing the directory when all are used; if the disk is full
+   returns null */
+dir_entry *get_empty_dir_entry(struct fs *fs, int *slot) {
+	if (fs->nfree_slots == 0 && grow_directory(fs) < 0) {
+		return NULL;
+	}
+	*slot = fs->free_slots[--fs->nfree_slots];
+	return dir_entry_at(fs, *slot);
+}
+
+/* Indexes the used directory entries by name and stacks the unused
+   ones, lowest slot on top. Reads the directory in runs of adjacent
+   blocks past the cache */
+void build_dir_index(struct fs *fs) {
+	char *buf = bufpool_get(BUFPOOL_MAX_BLOCKS);
+	int b = 0, i;
+
+	dirindex_destroy(fs->dirindex);
+	fs->dirindex = dirindex_init(N_DIR_ENTRIES);
+	fs->nfree_slots = 0;
+	while (b < fs->ndir_blocks) {
+		int run = 1;
+		while (b + run < fs->ndir_blocks && run < BUFPOOL_MAX_BLOCKS &&
+		       fs->dir_blocks[b + run] == fs->dir_blocks[b] + run) {
+			run++;
+		}
+		disk_read_blocks(fs->disk, fs->dir_blocks[b], run, buf);
+
+		dir_entry *entries = (dir_entry *) buf;
+		for (i = 0; i < run * N_DIR_ENTRIES; i++) {
+			int slot = b * N_DIR_ENTRIES + i;
+			if (entries[i].used) {
+				dirindex_insert(fs->dirindex, entries[i].name, slot);
+			} else {
+				fs->free_slots[fs->nfree_slots++] = slot;
+			}
+		}
+		b += run;
+	}
+	bufpool_put(buf, BUFPOOL_MAX_BLOCKS);
+
+	for (i = 0; i < fs->nfree_slots / 2; i++) {
+		int t = fs->free_slots[i];
+		fs->free_slots[i] = fs->free_slots[fs->nfree_slots - 1 - i];
+		fs->free_slots[fs->nfree_slots - 1 - i] = t;
+	}
+}
+
+/* Marks the free entries among fat entries [start, start + nblocks)
+   in freemap, for an allocation group used for the first time. Reads
+   the fat blocks past the cache: until the group is loaded its
+   entries only change between values that are not free, which the
+   disk may not have yet. Unwritten regions are free without a read */
+void load_group_fat(void *arg, int start, int nblocks, struct freemap *freemap) {
+	struct fs *fs = arg;
+	char *buf = bufpool_get(BUFPOOL_MAX_BLOCKS);
+	int first = start / N_ADDRESSES_PER_BLOCK;
+	int last = (start + nblocks - 1) / N_ADDRESSES_PER_BLOCK;
+	int b, i, run;
+	for (b = first; b <= last; b += run) {
+		unsigned int *entries = (unsigned int *) buf;
+		int from = b * N_ADDRESSES_PER_BLOCK;
+		int lazy = is_fat_lazy(fs, b);
+		run = 1;
+		while (b + run <= last && run < BUFPOOL_MAX_BLOCKS && is_fat_lazy(fs, b + run) == lazy) {
+			run++;
+		}
+		if (!lazy) {
+			disk_read_blocks(fs->disk, 2 + b, run, buf);
+		}
+		for (i = maximum_value(start, from); i < minimum_value(start + nblocks, from + run * (int) N_ADDRESSES_PER_BLOCK); i++) {
+			if (lazy || entries[i - from] == FREE) {
+				freemap_set_free(freemap, i - start);
+			}
+		}
+	}
+	bufpool_put(buf, BUFPOOL_MAX_BLOCKS);
+}
+
+/* Indexes the free fat entries. A disk last unmounted cleanly, with
+   nothing in the journal since, knows how many are free and each
+   allocation group reads its part of the fat when first used; any
+   other reads the whole fat now */
+void build_freemap(struct fs *fs, int replayed) {
+	int nfree = -1;
+	if (fs->journal_active && replayed == 0 && fs->mb.clean_seq == fs->journal_seq) {
+		nfree = fs->mb.free_blocks;
+	}
+	agroups_destroy(fs->groups);
+	fs->groups = agroups_init(fs->nblocks, nfree, load_group_fat, fs);
+
+	/* from here on the count is stale */
+	if (fs->mb.clean_seq != 0) {
+		fs->mb.clean_seq = 0;
+		write_superblock_to_disk(fs);
+		disk_sync(fs->disk);
 	}
-	
-	* starting_index = i;
-	return NULL;
 }
 
 /* Prints the fat blocks, only used for testing */
-void print_fat() {
+void print_fat(struct fs *fs) {
 	int i;
-	for(i = 0; i < nblocks; i++) {
-		if(fat[i] == FREE) {
+	for(i = 0; i < fs->nblocks; i++) {
+		unsigned int value = fat_get(fs, i);
+		if(value == FREE) {
 			printf("%d %s\n", i, FREE_STRING);
-		} else if(fat[i] == BUSY) {
+		} else if(value == BUSY) {
 			printf("%d %s\n", i, BUSY_STRING);
-		} else if(fat[i] == EOFF) {
+		} else if(value == EOFF) {
 			printf("%d %s\n", i, EOFF_STRING);
 		} else {
-			printf("%d %d\n", i, fat[i]);
+			printf("%d %d\n", i, value);
 		}
 		fflush(stdout);
 	}
 }
 
+/* Blocks of journal a format gives a disk of nblocks */
+int journal_size(int nblocks, int nfatblocks) {
+	int journal_blocks = minimum_value(JOURNAL_MAX_BLOCKS, maximum_value(JOURNAL_MIN_BLOCKS, nblocks / JOURNAL_DISK_SHARE));
+	if (2 + nfatblocks + journal_blocks >= nblocks) {
+		/* too small a disk to spare the blocks */
+		return 0;
+	}
+	return journal_blocks;
+}
+
 /* Formats the superblock */
-void format_superblock() {
-	nblocks = disk_size();
-	nfatblocks = up_rounded_division(nblocks, N_ADDRESSES_PER_BLOCK);
+void format_superblock(struct fs *fs) {
+	fs->nblocks = disk_size(fs->disk);
+	fs->nfatblocks = up_rounded_division(fs->nblocks, N_ADDRESSES_PER_BLOCK);
 
-	mb.magic = FS_MAGIC;
-	mb.nblocks = nblocks;
-	mb.nfatblocks = nfatblocks;
+	fs->mb.magic = FS_MAGIC;
+	fs->mb.nblocks = fs->nblocks;
+	fs->mb.nfatblocks = fs->nfatblocks;
+	fs->mb.journal_start = 2 + fs->nfatblocks;
+	fs->mb.journal_blocks = journal_size(fs->nblocks, fs->nfatblocks);
 
-	write_superblock_to_disk();
-}
+	/* unmounted clean with all but the metadata free, see format_fat */
+	int num_busy_blocks = 2 + fs->nfatblocks + fs->mb.journal_blocks;
+	fs->mb.clean_seq = (fs->mb.journal_blocks > 0) ? 1 : 0;
+	fs->mb.free_blocks = fs->nblocks - num_busy_blocks;
 
-/* Formats the directory */
-void format_directory() {
-	int i;
-	for (i = 0; i < N_DIR_ENTRIES; i++) {
-		dir[i].used = 0;
+	/* only the regions of the fat holding busy entries are written */
+	int region_blocks = up_rounded_division(fs->nfatblocks, FAT_LAZY_REGIONS);
+	int written = up_rounded_division(up_rounded_division(num_busy_blocks, (int) N_ADDRESSES_PER_BLOCK), region_blocks);
+	int r;
+	fs->mb.fat_region_blocks = region_blocks;
+	memset(fs->mb.fat_lazy, 0, sizeof(fs->mb.fat_lazy));
+	for (r = written; r * region_blocks < fs->nfatblocks; r++) {
+		fs->mb.fat_lazy[r / 8] |= 1 << (r % 8);
 	}
+}
+
+/* Formats the directory, a single empty block */
+void format_directory(struct fs *fs) {
+	char *block = bufpool_get(1);
+	memset(block, 0, DISK_BLOCK_SIZE);
+	disk_write(fs->disk, DIRBLOCK_NUM, block);
+	bufpool_put(block, 1);
 
-	write_dir_to_disk();
+	bcache_destroy(fs->dircache);
+	fs->dircache = NULL;
 }
 
-/* Formats the fat */
-void format_fat() {
-	fat = (unsigned int *) calloc(nblocks, sizeof(int));
-	
-	int num_busy_blocks = 2 + nfatblocks;
-	int i;
-	for (i = 0; i < num_busy_blocks; i++) {
-		fat[i] = BUSY;
+/* Formats the fat, the blocks up to the end of the journal busy and
+   the rest free. Only the regions format_superblock did not leave
+   unwritten go to disk, a buffer at a time */
+void format_fat(struct fs *fs) {
+	char *buf = bufpool_get(BUFPOOL_MAX_BLOCKS);
+	unsigned int *entries = (unsigned int *) buf;
+	int num_busy_blocks = 2 + fs->nfatblocks + fs->mb.journal_blocks;
+	int b, i;
+
+	bcache_destroy(fs->fatcache);
+	fs->fatcache = NULL;
+	int written = 0;
+	while (written < fs->nfatblocks && !is_fat_lazy(fs, written)) {
+		written++;
 	}
-	
-	write_fat_to_disk();
+	for (b = 0; b < written; b += BUFPOOL_MAX_BLOCKS) {
+		int run = minimum_value(written - b, BUFPOOL_MAX_BLOCKS);
+		int from = b * N_ADDRESSES_PER_BLOCK;
+		memset(buf, 0, run * DISK_BLOCK_SIZE);
+		for (i = from; i < minimum_value(num_busy_blocks, from + run * (int) N_ADDRESSES_PER_BLOCK); i++) {
+			entries[i - from] = BUSY;
+		}
+		disk_write_blocks(fs->disk, 2 + b, run, buf);
+	}
+	bufpool_put(buf, BUFPOOL_MAX_BLOCKS);
+}
+
+/* Formats the journal: zeroed, so no log block of an earlier format can
+   pass for a transaction, behind a header expecting the first one */
+void format_journal(struct fs *fs) {
+	if (fs->mb.journal_blocks == 0) {
+		return;
+	}
+	char *zeroes = bufpool_get(BUFPOOL_MAX_BLOCKS);
+	int b;
+	memset(zeroes, 0, BUFPOOL_MAX_BLOCKS * DISK_BLOCK_SIZE);
+	for (b = 1; b < fs->mb.journal_blocks; b += BUFPOOL_MAX_BLOCKS) {
+		int run = minimum_value(fs->mb.journal_blocks - b, BUFPOOL_MAX_BLOCKS);
+		disk_write_blocks(fs->disk, fs->mb.journal_start + b, run, zeroes);
+	}
+	bufpool_put(zeroes, BUFPOOL_MAX_BLOCKS);
+	fs->journal_seq = 1;
+	write_journal_header(fs);
 }
 
 /* Formats the disk */
-int fs_format(){
-	if(is_mounted()){
+int fs_format(struct fs *fs){
+	if(is_mounted(fs)){
 		printf("%s\n", CANT_FORMAT_MOUNTED);
 		return -1;
 	}
 	
-	read_superblock_from_disk();
+	read_superblock_from_disk(fs);
 	
-	format_superblock();
-	format_directory();
-	format_fat();
+	/* the superblock goes last, an interrupted format does not mount */
+	format_superblock(fs);
+	format_directory(fs);
+	format_fat(fs);
+	format_journal(fs);
+	write_superblock_to_disk(fs);
 
-	mb.magic = 0;
+	fs->mb.magic = 0;
 	return 0;
 }
 
-/* Prints a debug message */
-void fs_debug() {
-	
-	int current_magic = mb.magic;
-	
-	if(!is_mounted()) {
-		read_superblock_from_disk();
-		nblocks = mb.nblocks;
-		nfatblocks = mb.nfatblocks;
-		read_dir_from_disk();
-		read_fat_from_disk();
-		if(!is_mounted()) {
-			printf("%s\n", MISMATCH_MAGICNO);
-			return;
+/* Applies a fat record of a committed transaction to fat, or the
+   cached fat when NULL, skipping one that points off the disk */
+void replay_fat_record(struct fs *fs, journal_record *record, unsigned int *fat) {
+	unsigned int i, count = record->u.fat.count;
+	if (record->index >= fs->nblocks || count == 0 || count > fs->nblocks - record->index) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		unsigned int index = record->index + i;
+		unsigned int *entry = (fat != NULL) ? &fat[index] : fat_entry(fs, index);
+		if (record->kind == JR_FAT_FREE) {
+			*entry = FREE;
 		} else {
-			printf("%s\n", "superblock:");
-			printf("%s\n", UNMOUNT_DISK_ERROR);
+			*entry = (i == count - 1) ? record->u.fat.value : index + 1;
+		}
+		if (fat == NULL) {
+			bcache_mark(fs->fatcache, entry);
 		}
-	} else {
-		printf("%s\n", "superblock:");
-		printf("%s\n", MATCHING_MAGICNO);
 	}
-	
-	printf("%d%s\n", mb.nblocks, "blocks on disk");
-	printf("%d%s\n", mb.nfatblocks ,"blocks for file allocation table");
+}
 
-	int i;
-	for(i = 0; i < N_DIR_ENTRIES; i++) {
-		if(dir[i].used) {
-			printf("%s%s%s\n", "File \"", dir[i].name, "\":" );
-			printf("%s%d%s\n", "\tsize:", dir[i].length, " bytes");
-			int fat_index = dir[i].first_block;
-			if (fat_index != EOFF) {
-				printf("blocks: ");
-				do {
-					printf("%d ", fat_index);
-					fat_index = fat[fat_index];
-				} while (fat_index != EOFF);
-				printf("\n");
+/* Reads the transactions committed since the last checkpoint. The fat
+   records of each one are applied to replay->fat as it is found, the
+   directory records kept for once the fat gives the directory chain; a
+   block that is torn, stale or out of sequence ends the log and drops
+   the transaction it belongs to. Writes nothing, returns the number of
+   transactions read */
+int read_journal(journal_replay *replay) {
+	struct fs *fs = replay->fs;
+	char *block = bufpool_get(1);
+	journal_header *header = (journal_header *) block;
+	journal_block *log = (journal_block *) block;
+	int n = 0, found = 0, b, i;
+
+	disk_read(fs->disk, fs->mb.journal_start, block);
+	fs->journal_seq = (header->magic == JOURNAL_MAGIC) ? header->seq : 1;
+	fs->journal_next = fs->mb.journal_start + 1;
+
+	for (b = fs->mb.journal_start + 1; b < fs->mb.journal_start + fs->mb.journal_blocks; b++) {
+		disk_read(fs->disk, b, block);
+		if (log->magic != JOURNAL_MAGIC || log->seq != fs->journal_seq || log->nrecords < 0 ||
+		    log->nrecords > JOURNAL_RECORDS_PER_BLOCK || log->checksum != journal_checksum(block)) {
+			break;
+		}
+		fs->records = grow_array(fs->records, &fs->records_cap, n + log->nrecords, sizeof(journal_record));
+		memcpy(&fs->records[n], block + sizeof(journal_block), log->nrecords * sizeof(journal_record));
+		n += log->nrecords;
+		if (!log->commit) {
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			journal_record *record = &fs->records[i];
+			if (record->kind == JR_DIR) {
+				replay->dir_records = grow_array(replay->dir_records, &replay->dir_cap, replay->ndir + 1, sizeof(journal_record));
+				replay->dir_records[replay->ndir++] = *record;
+			} else {
+				replay_fat_record(fs, record, replay->fat);
 			}
 		}
+		n = 0;
+		fs->journal_seq++;
+		fs->journal_next = b + 1;
+		found++;
 	}
-	
-	mb.magic = current_magic;
-	
-//	print_fat();
+	bufpool_put(block, 1);
+	return found;
+}
+
+/* Redoes the transactions committed since the last checkpoint, then
+   checkpoints so the log starts empty. Returns the number of
+   transactions replayed */
+int replay_journal(struct fs *fs) {
+	journal_replay replay;
+	int i;
+
+	memset(&replay, 0, sizeof(replay));
+	replay.fs = fs;
+	int replayed = read_journal(&replay);
+
+	read_dir_from_disk(fs);
+	for (i = 0; i < replay.ndir; i++) {
+		if (replay.dir_records[i].index < fs->ndir_blocks * N_DIR_ENTRIES) {
+			dir_entry *entry = dir_entry_at(fs, replay.dir_records[i].index);
+			*entry = replay.dir_records[i].u.entry;
+			bcache_mark(fs->dircache, entry);
+		}
+	}
+	free(replay.dir_records);
+
+	if (replayed > 0) {
+		checkpoint(fs);
+	}
+	return replayed;
 }
 
 /* Mounts the disk */
-int fs_mount() {
-	if (is_mounted()) {
+int fs_mount(struct fs *fs) {
+	if (is_mounted(fs)) {
 		printf("%s\n", DISK_ALREADY_MOUNTED_ERROR);	
 		return -1;
 	}
 
-	read_superblock_from_disk();
+	read_superblock_from_disk(fs);
 	
-	if (!is_mounted()) {
+	if (fs->mb.magic == FS_MAGIC_V1) {
+		/* the superblock is rewritten once the directory grows, so
+		   older builds stop mounting it */
+		fs->mb.magic = FS_MAGIC;
+		fs->upgrade_superblock = TRUE;
+	} else if (fs->mb.magic == FS_MAGIC_V3 || fs->mb.magic == FS_MAGIC_V2) {
+		fs->mb.magic = FS_MAGIC;
+	}
+
+	if (!is_mounted(fs)) {
 		printf("%s\n", MISMATCH_MAGICNO);	
 		return -1;
 	}
 
-	nblocks = mb.nblocks;
-	nfatblocks = mb.nfatblocks;
+	fs->nblocks = fs->mb.nblocks;
+	fs->nfatblocks = fs->mb.nfatblocks;
 	
-	read_dir_from_disk();
-	read_fat_from_disk();
+	read_fat_from_disk(fs);
+	fs->journal_active = FALSE;
+	fs->nfat_log = fs->ndir_log = fs->npending_free = 0;
+	int replayed = 0;
+	if (fs->mb.journal_blocks > 0) {
+		replayed = replay_journal(fs);
+		fs->journal_active = TRUE;
+		/* after a commit the log has at least half its blocks left */
+		fs->commit_records = minimum_value(JOURNAL_COMMIT_RECORDS,
+			(fs->mb.journal_blocks - 1) / 2 * (int) JOURNAL_RECORDS_PER_BLOCK - JOURNAL_SPLIT_SLACK);
+		bcache_set_writeback_hook(fs->dircache, journal_writeback_hook, fs);
+		bcache_set_writeback_hook(fs->fatcache, journal_writeback_hook, fs);
+	} else {
+		read_dir_from_disk(fs);
+	}
+	build_freemap(fs, replayed);
+	build_dir_index(fs);
+	filemap_cache_destroy(fs->filemaps);
+	fs->filemaps = filemap_cache_init(FILEMAP_CACHE_FILES);
+	memset(fs->files, 0, sizeof(fs->files));
+	fs->delayed_bytes = 0;
+	fs->delayed_blocks = 0;
+	fs->unsynced_data = FALSE;
+	fs->unsynced_journal = FALSE;
+	fs->last_sync_ms = now_ms();
 		
 	return 0;
 }
 
+/* Free blocks, counting those the running transaction frees and not
+   those buffered appends will need; the caller holds meta_lock */
+int free_blocks(struct fs *fs) {
+	return agroups_free(fs->groups) + fs->npending_free - fs->delayed_blocks;
+}
+
+/* Returns the number of free blocks */
+int fs_free_blocks(struct fs *fs) {
+	if (!is_mounted(fs)) {
+		printf("%s\n", UNMOUNT_DISK_ERROR);
+		return -1;
+	}
+	pthread_mutex_lock(&fs->meta_lock);
+	int result = free_blocks(fs);
+	pthread_mutex_unlock(&fs->meta_lock);
+	return result;
+}
+
 /* Creates a file with filename file */
-int fs_create(char *name) {
-	if (!is_mounted()) {
+int fs_create(struct fs *fs, char *name) {
+	if (!is_mounted(fs)) {
 		printf("%s\n", UNMOUNT_DISK_ERROR);	
 		return -1;
 	}
@@ -317,15 +1329,20 @@ int fs_create(char *name) {
 		return -1;
 	}
 	
-	if(get_dir_entry(name) != NULL) {
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	if(dirindex_find(fs->dirindex, name) >= 0) {
+		pthread_rwlock_unlock(&fs->dir_lock);
 		printf("%s\n", FILE_ALREADY_EXISTS_ERROR);	
 		return -1;
 	}
 
-	
-	dir_entry *entry = get_empty_dir_entry();
+	pthread_mutex_lock(&fs->meta_lock);
+	int slot;
+	dir_entry *entry = get_empty_dir_entry(fs, &slot);
 	
 	if(entry == NULL) {
+		pthread_mutex_unlock(&fs->meta_lock);
+		pthread_rwlock_unlock(&fs->dir_lock);
 		printf("%s\n", DIR_FULL);
 		return -1;
 	}
@@ -334,16 +1351,19 @@ int fs_create(char *name) {
 	strcpy(entry->name, name);
 	entry->length = 0;
 	entry->first_block = EOFF;
-	
-	write_dir_to_disk();
+	mark_dir_entry(fs, slot, entry);
+	commit_metadata(fs);
+	pthread_mutex_unlock(&fs->meta_lock);
 
+	dirindex_insert(fs->dirindex, name, slot);
+	pthread_rwlock_unlock(&fs->dir_lock);
 	return 0;
 }
 
 /* Deletes a file with filename name */
-int fs_delete( char *name ) {
+int fs_delete( struct fs *fs, char *name ) {
 
-	if (!is_mounted()) {
+	if (!is_mounted(fs)) {
 		printf("%s\n", UNMOUNT_DISK_ERROR);
 		return -1;
 	}
@@ -353,33 +1373,178 @@ int fs_delete( char *name ) {
 		return -1;
 	}
 
-	dir_entry *entry = get_dir_entry(name);
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int slot = dirindex_find(fs->dirindex, name);
 	
-	if (entry == NULL) {
+	if (slot < 0) {
+		pthread_rwlock_unlock(&fs->dir_lock);
 		printf("%s\n", NO_SUCH_FILE_ERROR);
 		return -1;
 	}
+
+	pthread_mutex_lock(&fs->files_lock);
+	int fd;
+	for (fd = 0; fd < MAX_OPEN_FILES; fd++) {
+		if (fs->files[fd].used && fs->files[fd].slot == slot) {
+			pthread_mutex_unlock(&fs->files_lock);
+			pthread_rwlock_unlock(&fs->dir_lock);
+			printf("%s\n", FILE_IS_OPEN);
+			return -1;
+		}
+	}
+	/* a flush_all that found the file still open may pin its map a
+	   little longer; with dir_lock held nothing else can */
+	struct filemap *map;
+	while ((map = filemap_lookup(fs->filemaps, slot)) != NULL && map->refs > 0) {
+		pthread_cond_wait(&fs->map_released, &fs->files_lock);
+	}
+	filemap_drop(fs->filemaps, slot);
+	pthread_mutex_unlock(&fs->files_lock);
 	
+	/* the entry goes first, a commit in between leaves the rest of the
+	   chain unreachable rather than a file pointing at free blocks */
+	pthread_mutex_lock(&fs->meta_lock);
+	dir_entry *entry = dir_entry_at(fs, slot);
 	int fat_index = entry->first_block;
-	int temp_index;
-	while(fat_index != EOFF) {
+	int temp_index, steps = 0;
+	entry->used = FALSE;
+	mark_dir_entry(fs, slot, entry);
+	/* a broken chain, see fs_check, is freed up to where it goes wrong */
+	while(is_data_block(fs, fat_index) && steps++ < fs->nblocks) {
 		temp_index = fat_index;
-		fat_index = fat[fat_index];
-		fat[temp_index] = FREE;
+		fat_index = fat_get(fs, fat_index);
+		fat_set(fs, temp_index, FREE);
+		journal_split(fs);
 	}
+	agroups_release(fs->groups, slot);
+	commit_metadata(fs);
+	pthread_mutex_unlock(&fs->meta_lock);
 
-
-	entry->used = FALSE;
-	
-	write_dir_to_disk();
-	write_fat_to_disk();
-	
+	dirindex_remove(fs->dirindex, name);
+	fs->free_slots[fs->nfree_slots++] = slot;
+	pthread_rwlock_unlock(&fs->dir_lock);
 	return 0;
 }
 
+/* Returns the block map of the file in slot with a reference taken,
+   walking its chain once when the map is not cached; the caller holds
+   files_lock */
+struct filemap *hold_filemap(struct fs *fs, int slot) {
+	struct filemap *map = filemap_lookup(fs->filemaps, slot);
+	if (map == NULL) {
+		map = filemap_insert(fs->filemaps, slot);
+		map->version = __atomic_add_fetch(&fs->map_versions, 1, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&fs->meta_lock);
+		dir_entry *entry = dir_entry_at(fs, slot);
+		unsigned int block = entry->first_block;
+		map->length = entry->length;
+		while (is_data_block(fs, block) && map->nblocks < fs->nblocks) {
+			filemap_append(map, block);
+			block = fat_get(fs, block);
+		}
+		pthread_mutex_unlock(&fs->meta_lock);
+	}
+	map->refs++;
+	return map;
+}
+
+/* hold_filemap for callers without files_lock */
+struct filemap *get_filemap(struct fs *fs, int slot) {
+	pthread_mutex_lock(&fs->files_lock);
+	struct filemap *map = hold_filemap(fs, slot);
+	pthread_mutex_unlock(&fs->files_lock);
+	return map;
+}
+
+/* Blocks the file will need beyond those it has once its buffered
+   data is written */
+int delayed_blocks(struct filemap *map, int length) {
+	return maximum_value(0, up_rounded_division(length + map->dirty_len, DISK_BLOCK_SIZE) - map->nblocks);
+}
+
+/* An append buffer of at least size bytes, the smallest kept one that
+   fits or a new one; the caller holds files_lock */
+char *take_dirty_buffer(struct fs *fs, int size, int *cap) {
+	int i, best = -1;
+	for (i = 0; i < fs->ndirty_pool; i++) {
+		if (fs->dirty_pool_cap[i] >= size && (best < 0 || fs->dirty_pool_cap[i] < fs->dirty_pool_cap[best])) {
+			best = i;
+		}
+	}
+	if (best < 0) {
+		*cap = size;
+		return bufpool_alloc(size);
+	}
+	char *buf = fs->dirty_pool[best];
+	*cap = fs->dirty_pool_cap[best];
+	fs->ndirty_pool--;
+	fs->dirty_pool[best] = fs->dirty_pool[fs->ndirty_pool];
+	fs->dirty_pool_cap[best] = fs->dirty_pool_cap[fs->ndirty_pool];
+	return buf;
+}
+
+/* Keeps an append buffer for the next file that buffers, freeing it
+   when enough are kept; the caller holds files_lock */
+void put_dirty_buffer(struct fs *fs, char *buf, int cap) {
+	if (fs->ndirty_pool == DIRTY_POOL_BUFFERS) {
+		bufpool_free(buf, cap);
+		return;
+	}
+	fs->dirty_pool[fs->ndirty_pool] = buf;
+	fs->dirty_pool_cap[fs->ndirty_pool] = cap;
+	fs->ndirty_pool++;
+}
+
+/* Makes the map's append buffer hold size bytes, growing it in powers
+   of two up to DELAYED_FILE_MAX and keeping what it holds; the caller
+   holds the map's lock for writing */
+void grow_dirty_buffer(struct fs *fs, struct filemap *map, int size) {
+	if (size <= map->dirty_cap) {
+		return;
+	}
+	int want = DISK_BLOCK_SIZE;
+	while (want < size) {
+		want *= 2;
+	}
+	want = minimum_value(want, DELAYED_FILE_MAX);
+	pthread_mutex_lock(&fs->files_lock);
+	int cap;
+	char *buf = take_dirty_buffer(fs, want, &cap);
+	if (map->dirty != NULL) {
+		memcpy(buf, map->dirty, map->dirty_len);
+		put_dirty_buffer(fs, map->dirty, map->dirty_cap);
+	}
+	pthread_mutex_unlock(&fs->files_lock);
+	map->dirty = buf;
+	map->dirty_cap = cap;
+}
+
+/* Drops a reference taken by get_filemap; the last one frees the append
+   buffer, dropping what a failed fs_close could not write */
+void put_filemap(struct fs *fs, struct filemap *map) {
+	pthread_mutex_lock(&fs->files_lock);
+	map->refs--;
+	if (map->refs == 0) {
+		if (map->dirty_len > 0) {
+			pthread_mutex_lock(&fs->meta_lock);
+			fs->delayed_blocks -= delayed_blocks(map, map->length);
+			fs->delayed_bytes -= map->dirty_len;
+			pthread_mutex_unlock(&fs->meta_lock);
+			__atomic_store_n(&map->dirty_len, 0, __ATOMIC_RELAXED);
+		}
+		if (map->dirty != NULL) {
+			put_dirty_buffer(fs, map->dirty, map->dirty_cap);
+			map->dirty = NULL;
+			map->dirty_cap = 0;
+		}
+		pthread_cond_broadcast(&fs->map_released);
+	}
+	pthread_mutex_unlock(&fs->files_lock);
+}
+
 /* Returns the size of the file with filename name */
-int fs_getsize( char *name ){
-	if (!is_mounted()) {
+int fs_getsize( struct fs *fs, char *name ){
+	if (!is_mounted(fs)) {
 		printf("%s\n", UNMOUNT_DISK_ERROR);
 		return -1;
 	}
@@ -389,151 +1554,388 @@ int fs_getsize( char *name ){
 		return -1;
 	}	
 	
-	dir_entry * entry = get_dir_entry(name);
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int slot = dirindex_find(fs->dirindex, name);
 	
-	if (entry == NULL) {
+	if (slot < 0) {
+		pthread_rwlock_unlock(&fs->dir_lock);
 		printf("%s\n", NO_SUCH_FILE_ERROR);
 		return -1;
 	}
 	
-	return entry->length;
+	/* only a cached map has buffered bytes, the entry has the rest */
+	int size;
+	pthread_mutex_lock(&fs->files_lock);
+	struct filemap *map = filemap_lookup(fs->filemaps, slot);
+	if (map != NULL) {
+		map->refs++;
+		pthread_mutex_unlock(&fs->files_lock);
+		pthread_rwlock_rdlock(&map->lock);
+		size = map->length + map->dirty_len;
+		pthread_rwlock_unlock(&map->lock);
+		put_filemap(fs, map);
+	} else {
+		pthread_mutex_lock(&fs->meta_lock);
+		size = dir_entry_at(fs, slot)->length;
+		pthread_mutex_unlock(&fs->meta_lock);
+		pthread_mutex_unlock(&fs->files_lock);
+	}
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return size;
 }
 
-/* Gets the first block to use */
-unsigned int get_offset_block(unsigned int first_block, int offset) {
-	int current_fat_offset = 0;
-	while(current_fat_offset < offset)  {
-		if (first_block == EOFF) {
-			return -1;
-		}
-		first_block = fat[first_block];
-		current_fat_offset++;
+/* Gets the first block to use, EOFF just past the end of the file */
+unsigned int get_offset_block(struct filemap *map, int offset) {
+	if (offset > map->nblocks) {
+		return -1;
 	}
-	
-	return first_block;
+	if (offset == map->nblocks) {
+		return EOFF;
+	}
+	return map->blocks[offset];
+}
+
+/* Number of the file's blocks from index on, at most max, that lie
+   next to each other on disk */
+int contiguous_blocks(struct filemap *map, int index, int max) {
+	int run = 1;
+	max = minimum_value(max, map->nblocks - index);
+	while (run < max && map->blocks[index + run] == map->blocks[index] + run) {
+		run++;
+	}
+	return run;
+}
+
+/* Reads a partial block through a bounce buffer */
+void read_partial_block(struct fs *fs, unsigned int block, char *data, int block_offset, int size) {
+	char * temp = bufpool_get(1);
+	disk_read(fs->disk, block, temp);
+	memcpy(data, temp + block_offset, size);
+	bufpool_put(temp, 1);
 }
 
-/* Reads data from blocks */
-int  read_from_blocks(char * data, int read_size, unsigned int block, int first_block_offset) {
-	char * temp = (char *) malloc(DISK_BLOCK_SIZE);
+/* Reads data from the file's blocks starting at its block index; whole
+   blocks go straight into data, adjacent ones in one request, and only
+   a partial head or tail is copied */
+int  read_from_blocks(struct fs *fs, struct filemap *map, char * data, int read_size, int index, int first_block_offset) {
 	int current_read_size = 0;
-	while((current_read_size < read_size) && (block != EOFF)) {
-		disk_read(block, temp);
-		int mem_to_copy =  minimum_value(DISK_BLOCK_SIZE - first_block_offset, read_size - current_read_size);
-		memcpy(data, temp + first_block_offset, mem_to_copy);
-		first_block_offset = 0;
-		
-		block = fat[block];
+	
+	if (read_size > 0 && index < map->nblocks && (first_block_offset > 0 || read_size < DISK_BLOCK_SIZE)) {
+		int mem_to_copy = minimum_value(DISK_BLOCK_SIZE - first_block_offset, read_size);
+		read_partial_block(fs, map->blocks[index], data, first_block_offset, mem_to_copy);
 		data += mem_to_copy;
 		current_read_size += mem_to_copy;
+		index++;
+	}
+	
+	int full_blocks = minimum_value((read_size - current_read_size) / DISK_BLOCK_SIZE, map->nblocks - index);
+	while (full_blocks > 0) {
+		int run = contiguous_blocks(map, index, full_blocks);
+		disk_read_blocks(fs->disk, map->blocks[index], run, data);
+		data += run * DISK_BLOCK_SIZE;
+		current_read_size += run * DISK_BLOCK_SIZE;
+		index += run;
+		full_blocks -= run;
+	}
+	
+	if (current_read_size < read_size && index < map->nblocks) {
+		int mem_to_copy = read_size - current_read_size;
+		read_partial_block(fs, map->blocks[index], data, 0, mem_to_copy);
+		current_read_size += mem_to_copy;
 	}
 	
-	free(temp);
 	return current_read_size;
 }
 
-/* Reads data */
-int fs_read( char *name, char *data, int length, int offset) {
+/* Picks the next extent for the file in slot whose last block is last;
+   returns its start and length, -1 when the disk is full */
+int allocate_extent(struct fs *fs, int slot, unsigned int last, int need, int *len) {
+	int goal = (last == EOFF) ? -1 : last + 1;
+	int start = agroups_alloc(fs->groups, slot, goal, need, len);
+	if (start < 0 && agroups_reserved(fs->groups) > 0) {
+		/* out of space: other files' windows are fair game */
+		agroups_release_all(fs->groups);
+		start = agroups_alloc(fs->groups, slot, goal, need, len);
+	}
+	if (start < 0) {
+		/* and so are blocks freed by a transaction once it commits */
+		pthread_mutex_lock(&fs->meta_lock);
+		int pending = fs->npending_free;
+		if (pending > 0) {
+			journal_commit(fs);
+		}
+		pthread_mutex_unlock(&fs->meta_lock);
+		if (pending > 0) {
+			start = agroups_alloc(fs->groups, slot, goal, need, len);
+		}
+	}
+	return start;
+}
+
+/* Allocate new blocks, as few extents as possible placed after the
+   file's current last block. The blocks come from the allocation
+   groups, meta_lock is only taken to link each extent in; the caller
+   holds the map's lock for writing */
+int find_more_blocks(struct fs *fs, struct filemap *map, int number_of_blocks) {
+
+	if (map->nblocks >= number_of_blocks) {
+		return number_of_blocks;
+	}
+
+	int blocks_found = map->nblocks;
+	unsigned int last = EOFF;
+	if (map->nblocks > 0) {
+		last = map->blocks[map->nblocks - 1];
+	}
 	
-	if (!is_mounted()) {
-		printf("%s\n", UNMOUNT_DISK_ERROR);
-		return -1;
+	while (blocks_found < number_of_blocks) {
+		int len;
+		int start = allocate_extent(fs, map->slot, last, number_of_blocks - blocks_found, &len);
+		if (start < 0) {
+			break;
+		}
+		
+		/* linked from the end, a commit in between leaves the extent
+		   unreachable rather than the file ending in free blocks */
+		pthread_mutex_lock(&fs->meta_lock);
+		int i;
+		for (i = start + len - 1; i >= start; i--) {
+			fat_set(fs, i, (i == start + len - 1) ? EOFF : (unsigned int) i + 1);
+			journal_split(fs);
+		}
+		set_link(fs, map->slot, last, start);
+		for (i = start; i < start + len; i++) {
+			filemap_append(map, i);
+		}
+		pthread_mutex_unlock(&fs->meta_lock);
+		last = start + len - 1;
+		blocks_found += len;
 	}
 	
-	if(!is_name_valid(name)) {
-		printf("%s\n", INVALID_FILENAME);
-		return -1;
+	return blocks_found;
+}
+
+/* Writes a partial block through a bounce buffer, merged with what the
+   block holds when it lies inside the file and zero filled when not */
+void write_partial_block(struct fs *fs, unsigned int block, const char *data, int block_offset, int size, int has_data) {
+	char * temp = bufpool_get(1);
+	if (has_data) {
+		disk_read(fs->disk, block, temp);
+	} else {
+		memset(temp, 0, DISK_BLOCK_SIZE);
+	}
+	memcpy(temp + block_offset, data, size);
+	disk_write(fs->disk, block, temp);
+	bufpool_put(temp, 1);
+}
+
+/* Zeroes the file's blocks from index first up to last, so a hole left
+   by a write past the end reads back as zeroes */
+void zero_blocks(struct fs *fs, struct filemap *map, int first, int last) {
+	char *zeroes = bufpool_get(BUFPOOL_MAX_BLOCKS);
+	memset(zeroes, 0, BUFPOOL_MAX_BLOCKS * DISK_BLOCK_SIZE);
+	while (first < last) {
+		int run = contiguous_blocks(map, first, minimum_value(last - first, BUFPOOL_MAX_BLOCKS));
+		disk_write_blocks(fs->disk, map->blocks[first], run, zeroes);
+		first += run;
+	}
+	bufpool_put(zeroes, BUFPOOL_MAX_BLOCKS);
+}
+
+/* Writes data to the file's blocks starting at its block index; whole
+   blocks go straight from data, adjacent ones in one request, and only
+   a partial head or tail is merged. file_length is the length before
+   the write */
+int  write_to_blocks(struct fs *fs, struct filemap *map, const char * data, int write_size, int index, int first_block_offset, int file_length) {
+	int current_write_size = 0;
+	
+	if (write_size > 0 && index < map->nblocks && (first_block_offset > 0 || write_size < DISK_BLOCK_SIZE)) {
+		int mem_to_copy = minimum_value(DISK_BLOCK_SIZE - first_block_offset, write_size);
+		int has_data = (long) index * DISK_BLOCK_SIZE < file_length;
+		write_partial_block(fs, map->blocks[index], data, first_block_offset, mem_to_copy, has_data);
+		data += mem_to_copy;
+		current_write_size += mem_to_copy;
+		index++;
 	}
 	
-	dir_entry * entry = get_dir_entry(name);
+	int full_blocks = minimum_value((write_size - current_write_size) / DISK_BLOCK_SIZE, map->nblocks - index);
+	while (full_blocks > 0) {
+		int run = contiguous_blocks(map, index, full_blocks);
+		disk_write_blocks(fs->disk, map->blocks[index], run, data);
+		data += run * DISK_BLOCK_SIZE;
+		current_write_size += run * DISK_BLOCK_SIZE;
+		index += run;
+		full_blocks -= run;
+	}
 	
-	if (entry == NULL) {
-		printf("%s\n", NO_SUCH_FILE_ERROR);
-		return -1;
+	if (current_write_size < write_size && index < map->nblocks) {
+		int mem_to_copy = write_size - current_write_size;
+		int has_data = (long) index * DISK_BLOCK_SIZE < file_length;
+		write_partial_block(fs, map->blocks[index], data, 0, mem_to_copy, has_data);
+		current_write_size += mem_to_copy;
 	}
 	
+	return current_write_size;
+}
+
+/* Writes data to the file in slot whose block map is map; the caller
+   holds the map's lock for writing */
+int write_file(struct fs *fs, int slot, struct filemap *map, const char *data, int length, int offset) {
 	int fat_offset = (offset / DISK_BLOCK_SIZE);
 	int block_offset = offset % DISK_BLOCK_SIZE;
-	int read_size = minimum_value(entry->length - fat_offset * DISK_BLOCK_SIZE - block_offset, length);
 	
-	unsigned int first_read_block = (get_offset_block(entry->first_block, fat_offset));
+	int blocks_needed = up_rounded_division(length + offset, DISK_BLOCK_SIZE);
+	int blocks_found = map->nblocks;
+	if (blocks_needed > map->nblocks) {
+		blocks_found = find_more_blocks(fs, map, blocks_needed);
+	}
 	
-	if (first_read_block == -1) {
+	if (blocks_found == 0) {
+		printf("%s\n", NO_SPACE);
 		return -1;
+	} else if (blocks_found < blocks_needed) {
+		printf("%s\n", NO_SPACE_FOR_FILE);
 	}
 	
-	int result = read_from_blocks(data, read_size, first_read_block, block_offset);
+	int first_unwritten = up_rounded_division(map->length, DISK_BLOCK_SIZE);
+	if (fat_offset > first_unwritten) {
+		zero_blocks(fs, map, first_unwritten, minimum_value(fat_offset, map->nblocks));
+	}
+	
+	int result =  write_to_blocks(fs, map, data, length, fat_offset, block_offset, map->length);
+	__atomic_store_n(&fs->unsynced_data, TRUE, __ATOMIC_RELEASE);
+	map->version = __atomic_add_fetch(&fs->map_versions, 1, __ATOMIC_RELAXED);
+	
+	pthread_mutex_lock(&fs->meta_lock);
+	if (result + offset > map->length) {
+		dir_entry *entry = dir_entry_at(fs, slot);
+		entry->length = result + offset;
+		mark_dir_entry(fs, slot, entry);
+		map->length = entry->length;
+	}
+	commit_metadata(fs);
+	pthread_mutex_unlock(&fs->meta_lock);
 	
 	return result;
 }
 
-/* Allocate new blocks */
-int find_more_blocks(unsigned int * original_block, int number_of_blocks) {
+/* Writes the file's buffered appends, allocating their blocks in one
+   go now that the final size is known. What does not fit, when the
+   disk is full, stays buffered for a later flush; the caller holds the
+   map's lock for writing */
+int flush_file(struct fs *fs, struct filemap *map) {
+	if (map->dirty_len == 0) {
+		return 0;
+	}
+	int length = map->dirty_len;
+	pthread_mutex_lock(&fs->meta_lock);
+	fs->delayed_blocks -= delayed_blocks(map, map->length);
+	fs->delayed_bytes -= length;
+	pthread_mutex_unlock(&fs->meta_lock);
 
-	int blocks_found = 0;
-	unsigned int * block = original_block;
-	while (blocks_found < number_of_blocks) {
-		if (*block == EOFF) {
-			break;
-		}
-		
-		block = &fat[*block];
-		blocks_found++;
+	int result = write_file(fs, map->slot, map, map->dirty, length, map->length);
+	int written = maximum_value(result, 0);
+	if (written < length) {
+		memmove(map->dirty, map->dirty + written, length - written);
 	}
-	
-	int fat_index = 0;
-	while (blocks_found < number_of_blocks) {
-		unsigned int * fat_entry = get_empty_fat_entry(&fat_index);
-		if (fat_entry == NULL ) {
-			break;
+	__atomic_store_n(&map->dirty_len, length - written, __ATOMIC_RELAXED);
+	if (written < length) {
+		pthread_mutex_lock(&fs->meta_lock);
+		fs->delayed_blocks += delayed_blocks(map, map->length);
+		fs->delayed_bytes += length - written;
+		pthread_mutex_unlock(&fs->meta_lock);
+		return -1;
+	}
+	return 0;
+}
+
+/* Writes the buffered appends of every open file. held is a map the
+   caller has locked for writing, or NULL; while it holds one, files
+   busy in other threads are skipped rather than waited for */
+int flush_all(struct fs *fs, struct filemap *held) {
+	struct filemap *maps[MAX_OPEN_FILES];
+	int n = 0, fd, i, result = 0;
+
+	pthread_mutex_lock(&fs->files_lock);
+	/* dirty_len is read without the map lock, flush_file checks it again */
+	for (fd = 0; fd < MAX_OPEN_FILES; fd++) {
+		struct filemap *map = fs->files[fd].map;
+		if (!fs->files[fd].used || __atomic_load_n(&map->dirty_len, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		for (i = 0; i < n && maps[i] != map; i++);
+		if (i == n) {
+			maps[n++] = map;
+			map->refs++;
 		}
-		
-		* block = fat_index;
-		block = fat_entry;
-		blocks_found++;
-		fat_index++;
 	}
-	
-	if (*block == FREE) {
-		* block = EOFF;
+	pthread_mutex_unlock(&fs->files_lock);
+
+	for (i = 0; i < n; i++) {
+		if (maps[i] == held) {
+			result |= flush_file(fs, held);
+		} else if (held == NULL || pthread_rwlock_trywrlock(&maps[i]->lock) == 0) {
+			if (held == NULL) {
+				pthread_rwlock_wrlock(&maps[i]->lock);
+			}
+			result |= flush_file(fs, maps[i]);
+			pthread_rwlock_unlock(&maps[i]->lock);
+		}
+		put_filemap(fs, maps[i]);
 	}
-	
-	return blocks_found;
+	return result;
 }
 
-/* Writes to blocks */
-int  write_to_blocks(const char * data, int write_size, unsigned int block, int first_block_offset) {
-	char * temp = (char *) malloc(DISK_BLOCK_SIZE);
-	
-	int current_write_size = 0;
-	while((current_write_size < write_size) && (block != EOFF)) {
-		
-		int mem_to_copy;
-		if((first_block_offset > 0) || (write_size - current_write_size < DISK_BLOCK_SIZE)) {
-			disk_read(block, temp);
-			mem_to_copy = minimum_value(DISK_BLOCK_SIZE - first_block_offset, write_size - current_write_size);
-		} else {
-			mem_to_copy = DISK_BLOCK_SIZE;
+/* Writes data to an open file. Appends that fit are only copied into
+   the file's buffer, everything else flushes it and goes to disk, as
+   does every write when each operation must be durable. The caller
+   holds the map's lock for writing */
+int write_open_file(struct fs *fs, open_file *file, const char *data, int length, int offset) {
+	struct filemap *map = file->map;
+	int end = map->length + map->dirty_len;
+
+	if (offset != end || length <= 0 || length > DELAYED_FILE_MAX / 2 || fs->durability == FS_DURABLE_OP) {
+		if (flush_file(fs, map) < 0) {
+			return -1;
 		}
+		return write_file(fs, file->slot, map, data, length, offset);
+	}
 
-		memcpy(temp + first_block_offset, data, mem_to_copy);
-		
-		disk_write(block, data);
-		first_block_offset = 0;
-		
-		block = fat[block];
-		
-		data += mem_to_copy;
-		current_write_size += mem_to_copy;
+	if (map->dirty_len + length > DELAYED_FILE_MAX && flush_file(fs, map) < 0) {
+		return -1;
 	}
-	
-	return current_write_size;
+	pthread_mutex_lock(&fs->meta_lock);
+	int pressure = fs->delayed_bytes + length > DELAYED_TOTAL_MAX;
+	pthread_mutex_unlock(&fs->meta_lock);
+	if (pressure && flush_all(fs, map) < 0) {
+		/* memory pressure: the other files go out too */
+		return -1;
+	}
+
+	int more_blocks = delayed_blocks(map, map->length + length) - delayed_blocks(map, map->length);
+	pthread_mutex_lock(&fs->meta_lock);
+	if (more_blocks > free_blocks(fs)) {
+		pthread_mutex_unlock(&fs->meta_lock);
+		/* would not fit, let the write report how much does */
+		if (flush_file(fs, map) < 0) {
+			return -1;
+		}
+		return write_file(fs, file->slot, map, data, length, offset);
+	}
+	fs->delayed_bytes += length;
+	fs->delayed_blocks += more_blocks;
+	pthread_mutex_unlock(&fs->meta_lock);
+
+	grow_dirty_buffer(fs, map, map->dirty_len + length);
+	memcpy(map->dirty + map->dirty_len, data, length);
+	__atomic_store_n(&map->dirty_len, map->dirty_len + length, __ATOMIC_RELAXED);
+	return length;
 }
 
 /* Writes data */
-int fs_write( char *name, const char *data, int length, int offset ) {
+int fs_write( struct fs *fs, char *name, const char *data, int length, int offset ) {
 
-	if (!is_mounted()) {
+	if (!is_mounted(fs)) {
 		printf("%s\n", UNMOUNT_DISK_ERROR);
 		return -1;
 	}
@@ -542,35 +1944,1185 @@ int fs_write( char *name, const char *data, int length, int offset ) {
 		printf("%s \n", INVALID_FILENAME);
 		return -1;
 	}
+
+	if (offset < 0) {
+		printf("%s\n", INVALID_OFFSET);
+		return -1;
+	}
 	
-	dir_entry * entry = get_dir_entry(name);
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int slot = dirindex_find(fs->dirindex, name);
+	
+	if (slot < 0) {
+		pthread_rwlock_unlock(&fs->dir_lock);
+		printf("%s\n", NO_SUCH_FILE_ERROR);
+		return -1;
+	}
 	
-	if (entry == NULL) {
+	struct filemap *map = get_filemap(fs, slot);
+	pthread_rwlock_wrlock(&map->lock);
+	int result = flush_file(fs, map);
+	if (result == 0) {
+		result = write_file(fs, slot, map, data, length, offset);
+	}
+	pthread_rwlock_unlock(&map->lock);
+	put_filemap(fs, map);
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return result;
+}
+
+/* Cuts the chain of the file whose block map is map after its first n
+   blocks and frees the rest; the chain is cut before its tail is freed,
+   as in fs_delete. The caller holds the map's lock for writing and
+   meta_lock */
+void cut_chain(struct fs *fs, struct filemap *map, int n) {
+	int i;
+	if (map->nblocks <= n) {
+		return;
+	}
+	set_link(fs, map->slot, (n > 0) ? map->blocks[n - 1] : EOFF, EOFF);
+	for (i = n; i < map->nblocks; i++) {
+		fat_set(fs, map->blocks[i], FREE);
+		journal_split(fs);
+	}
+	map->nblocks = n;
+	agroups_release(fs->groups, map->slot);
+}
+
+/* Reserves blocks for the first length bytes of the file, as one
+   extent after its last block when the disk has one; the file's length
+   stays, later writes land in the blocks without allocating */
+int fs_fallocate( struct fs *fs, char *name, int length ) {
+
+	if (!is_mounted(fs)) {
+		printf("%s\n", UNMOUNT_DISK_ERROR);
+		return -1;
+	}
+
+	if(!is_name_valid(name)) {
+		printf("%s\n", INVALID_FILENAME);
+		return -1;
+	}
+
+	if (length < 0) {
+		printf("%s\n", INVALID_LENGTH);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int slot = dirindex_find(fs->dirindex, name);
+
+	if (slot < 0) {
+		pthread_rwlock_unlock(&fs->dir_lock);
+		printf("%s\n", NO_SUCH_FILE_ERROR);
+		return -1;
+	}
+
+	struct filemap *map = get_filemap(fs, slot);
+	pthread_rwlock_wrlock(&map->lock);
+	int result = flush_file(fs, map);
+	int blocks_had = map->nblocks;
+	int blocks_needed = up_rounded_division(length, DISK_BLOCK_SIZE);
+	if (result == 0 && blocks_needed > map->nblocks) {
+		pthread_mutex_lock(&fs->meta_lock);
+		int fits = blocks_needed - map->nblocks <= free_blocks(fs);
+		pthread_mutex_unlock(&fs->meta_lock);
+		if (!fits) {
+			printf("%s\n", NO_SPACE);
+			result = -1;
+		} else if (find_more_blocks(fs, map, blocks_needed) < blocks_needed) {
+			printf("%s\n", NO_SPACE_FOR_FILE);
+			result = -1;
+		}
+		map->version = __atomic_add_fetch(&fs->map_versions, 1, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&fs->meta_lock);
+		if (result < 0) {
+			cut_chain(fs, map, blocks_had);
+		}
+		commit_metadata(fs);
+		pthread_mutex_unlock(&fs->meta_lock);
+	}
+	pthread_rwlock_unlock(&map->lock);
+	put_filemap(fs, map);
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return result;
+}
+
+/* Sets the file's length. Blocks past the new end, preallocated ones
+   too, are freed and the rest of its last block zeroed; a longer file
+   reads back zeroes past the old end */
+int fs_truncate( struct fs *fs, char *name, int length ) {
+
+	if (!is_mounted(fs)) {
+		printf("%s\n", UNMOUNT_DISK_ERROR);
+		return -1;
+	}
+
+	if(!is_name_valid(name)) {
+		printf("%s\n", INVALID_FILENAME);
+		return -1;
+	}
+
+	if (length < 0) {
+		printf("%s\n", INVALID_LENGTH);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int slot = dirindex_find(fs->dirindex, name);
+
+	if (slot < 0) {
+		pthread_rwlock_unlock(&fs->dir_lock);
 		printf("%s\n", NO_SUCH_FILE_ERROR);
 		return -1;
 	}
+
+	struct filemap *map = get_filemap(fs, slot);
+	pthread_rwlock_wrlock(&map->lock);
+	int result = flush_file(fs, map);
+	int blocks_had = map->nblocks;
+	int blocks_needed = up_rounded_division(length, DISK_BLOCK_SIZE);
+	int first_unwritten = up_rounded_division(map->length, DISK_BLOCK_SIZE);
+
+	if (result == 0 && blocks_needed > map->nblocks) {
+		pthread_mutex_lock(&fs->meta_lock);
+		int fits = blocks_needed - map->nblocks <= free_blocks(fs);
+		pthread_mutex_unlock(&fs->meta_lock);
+		if (!fits || find_more_blocks(fs, map, blocks_needed) < blocks_needed) {
+			printf("%s\n", NO_SPACE);
+			result = -1;
+		}
+	}
+	if (result == 0 && length > map->length) {
+		zero_blocks(fs, map, first_unwritten, blocks_needed);
+		__atomic_store_n(&fs->unsynced_data, TRUE, __ATOMIC_RELEASE);
+	} else if (result == 0 && length % DISK_BLOCK_SIZE != 0 && length < map->length) {
+		/* so a later write past the end finds zeroes there */
+		char *zeroes = bufpool_get(1);
+		memset(zeroes, 0, DISK_BLOCK_SIZE);
+		write_partial_block(fs, map->blocks[length / DISK_BLOCK_SIZE], zeroes, length % DISK_BLOCK_SIZE,
+		                    DISK_BLOCK_SIZE - length % DISK_BLOCK_SIZE, TRUE);
+		bufpool_put(zeroes, 1);
+		__atomic_store_n(&fs->unsynced_data, TRUE, __ATOMIC_RELEASE);
+	}
+	map->version = __atomic_add_fetch(&fs->map_versions, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&fs->meta_lock);
+	if (result == 0) {
+		dir_entry *entry = dir_entry_at(fs, slot);
+		entry->length = length;
+		mark_dir_entry(fs, slot, entry);
+		map->length = length;
+		cut_chain(fs, map, blocks_needed);
+	} else {
+		/* a grow that did not fit gives back what it got */
+		cut_chain(fs, map, blocks_had);
+	}
+	commit_metadata(fs);
+	pthread_mutex_unlock(&fs->meta_lock);
+
+	pthread_rwlock_unlock(&map->lock);
+	put_filemap(fs, map);
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return result;
+}
+
+/* Reads data from the file whose block map is map. Readers share the
+   map's lock; only one that finds buffered appends to flush takes it
+   for writing */
+int read_file(struct fs *fs, struct filemap *map, char *data, int length, int offset) {
+	pthread_rwlock_rdlock(&map->lock);
+	if (map->dirty_len > 0) {
+		pthread_rwlock_unlock(&map->lock);
+		pthread_rwlock_wrlock(&map->lock);
+		if (flush_file(fs, map) < 0) {
+			pthread_rwlock_unlock(&map->lock);
+			return -1;
+		}
+	}
 	
 	int fat_offset = (offset / DISK_BLOCK_SIZE);
 	int block_offset = offset % DISK_BLOCK_SIZE;
+	int read_size = minimum_value((int) map->length - fat_offset * DISK_BLOCK_SIZE - block_offset, length);
 	
-	int blocks_needed = up_rounded_division(length + offset, DISK_BLOCK_SIZE);
-	int blocks_found = find_more_blocks(&(entry->first_block), blocks_needed);
+	int result = -1;
+	if (get_offset_block(map, fat_offset) != -1) {
+		result = read_from_blocks(fs, map, data, read_size, fat_offset, block_offset);
+	}
+	pthread_rwlock_unlock(&map->lock);
+	return result;
+}
+
+/* Reads data */
+int fs_read( struct fs *fs, char *name, char *data, int length, int offset) {
 	
-	if (blocks_found == 0) {
-		printf("%s\n", NO_SPACE);
+	if (!is_mounted(fs)) {
+		printf("%s\n", UNMOUNT_DISK_ERROR);
 		return -1;
-	} else if (blocks_found < blocks_needed) {
-		printf("%s\n", NO_SPACE_FOR_FILE);
 	}
 	
-	unsigned int first_write_block = get_offset_block(entry->first_block, fat_offset);
-	
-	int result =  write_to_blocks(data, length, first_write_block, block_offset);
+	if(!is_name_valid(name)) {
+		printf("%s\n", INVALID_FILENAME);
+		return -1;
+	}
+
+	if (offset < 0) {
+		printf("%s\n", INVALID_OFFSET);
+		return -1;
+	}
 	
-	entry->length = maximum_value(entry->length, result + offset);
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int slot = dirindex_find(fs->dirindex, name);
 	
-	write_dir_to_disk();
-	write_fat_to_disk();
+	if (slot < 0) {
+		pthread_rwlock_unlock(&fs->dir_lock);
+		printf("%s\n", NO_SUCH_FILE_ERROR);
+		return -1;
+	}
 	
+	struct filemap *map = get_filemap(fs, slot);
+	int result = read_file(fs, map, data, length, offset);
+	put_filemap(fs, map);
+	pthread_rwlock_unlock(&fs->dir_lock);
 	return result;
-}
\ No newline at end of file
+}
+
+/* Returns the open file behind descriptor fd, NULL if it is not one.
+   Takes no lock: a descriptor must not be closed while in use */
+open_file *get_open_file(struct fs *fs, int fd) {
+	if (fd < 0 || fd >= MAX_OPEN_FILES || !fs->files[fd].used) {
+		printf("%s\n", BAD_DESCRIPTOR);
+		return NULL;
+	}
+	return &fs->files[fd];
+}
+
+/* Opens the file with filename name, returns its descriptor */
+int fs_open( struct fs *fs, char *name ) {
+	if (!is_mounted(fs)) {
+		printf("%s\n", UNMOUNT_DISK_ERROR);
+		return -1;
+	}
+
+	if(!is_name_valid(name)) {
+		printf("%s\n", INVALID_FILENAME);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int slot = dirindex_find(fs->dirindex, name);
+
+	if (slot < 0) {
+		pthread_rwlock_unlock(&fs->dir_lock);
+		printf("%s\n", NO_SUCH_FILE_ERROR);
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->files_lock);
+	int fd;
+	for (fd = 0; fd < MAX_OPEN_FILES; fd++) {
+		if (!fs->files[fd].used) {
+			break;
+		}
+	}
+	if (fd == MAX_OPEN_FILES) {
+		pthread_mutex_unlock(&fs->files_lock);
+		pthread_rwlock_unlock(&fs->dir_lock);
+		printf("%s\n", TOO_MANY_OPEN_FILES);
+		return -1;
+	}
+
+	open_file *file = &fs->files[fd];
+	file->slot = slot;
+	file->map = hold_filemap(fs, slot);
+	file->pos = 0;
+	file->used = TRUE;
+	pthread_mutex_unlock(&fs->files_lock);
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return fd;
+}
+
+/* Closes descriptor fd */
+int fs_close( struct fs *fs, int fd ) {
+	open_file *file = get_open_file(fs, fd);
+	if (file == NULL) {
+		return -1;
+	}
+	struct filemap *map = file->map;
+	pthread_rwlock_wrlock(&map->lock);
+	int result = flush_file(fs, map);
+	pthread_rwlock_unlock(&map->lock);
+
+	pthread_mutex_lock(&fs->files_lock);
+	file->used = FALSE;
+	pthread_mutex_unlock(&fs->files_lock);
+	put_filemap(fs, map);
+	return result;
+}
+
+/* Reads data at offset from an open file */
+int fs_pread( struct fs *fs, int fd, char *data, int length, int offset ) {
+	open_file *file = get_open_file(fs, fd);
+	if (file == NULL) {
+		return -1;
+	}
+	if (offset < 0) {
+		printf("%s\n", INVALID_OFFSET);
+		return -1;
+	}
+	return read_file(fs, file->map, data, length, offset);
+}
+
+/* Writes data at offset to an open file */
+int fs_pwrite( struct fs *fs, int fd, const char *data, int length, int offset ) {
+	open_file *file = get_open_file(fs, fd);
+	if (file == NULL) {
+		return -1;
+	}
+	if (offset < 0) {
+		printf("%s\n", INVALID_OFFSET);
+		return -1;
+	}
+	pthread_rwlock_wrlock(&file->map->lock);
+	int result = write_open_file(fs, file, data, length, offset);
+	pthread_rwlock_unlock(&file->map->lock);
+	return result;
+}
+
+/* Reads data at the cursor of an open file and moves the cursor past it */
+int fs_fread( struct fs *fs, int fd, char *data, int length ) {
+	open_file *file = get_open_file(fs, fd);
+	if (file == NULL) {
+		return -1;
+	}
+	int result = read_file(fs, file->map, data, length, file->pos);
+	if (result > 0) {
+		file->pos += result;
+	}
+	return result;
+}
+
+/* Writes data at the cursor of an open file and moves the cursor past it */
+int fs_fwrite( struct fs *fs, int fd, const char *data, int length ) {
+	open_file *file = get_open_file(fs, fd);
+	if (file == NULL) {
+		return -1;
+	}
+	pthread_rwlock_wrlock(&file->map->lock);
+	int result = write_open_file(fs, file, data, length, file->pos);
+	pthread_rwlock_unlock(&file->map->lock);
+	if (result > 0) {
+		file->pos += result;
+	}
+	return result;
+}
+
+/* Moves the cursor of an open file to offset */
+int fs_seek( struct fs *fs, int fd, int offset ) {
+	open_file *file = get_open_file(fs, fd);
+	if (file == NULL) {
+		return -1;
+	}
+	if (offset < 0) {
+		printf("%s\n", INVALID_OFFSET);
+		return -1;
+	}
+	file->pos = offset;
+	return offset;
+}
+
+/* Writes everything buffered by open files to the disk and commits the
+   metadata changes still waiting for their group */
+int fs_sync( struct fs *fs ) {
+	if (!is_mounted(fs)) {
+		printf("%s\n", UNMOUNT_DISK_ERROR);
+		return -1;
+	}
+	int result = flush_all(fs, NULL);
+	pthread_mutex_lock(&fs->meta_lock);
+	commit_group(fs);
+	pthread_mutex_unlock(&fs->meta_lock);
+	return result;
+}
+
+/* Sets when changes become durable, interval_ms is used by
+   FS_DURABLE_PERIODIC and 0 keeps the current one */
+int fs_set_durability( struct fs *fs, int mode, int interval_ms ) {
+	if (mode < FS_DURABLE_NONE || mode > FS_DURABLE_BARRIER || interval_ms < 0) {
+		printf("%s\n", INVALID_DURABILITY);
+		return -1;
+	}
+	pthread_mutex_lock(&fs->meta_lock);
+	if (is_mounted(fs)) {
+		/* what the old mode left pending is settled under it */
+		commit_group(fs);
+	}
+	fs->durability = mode;
+	if (interval_ms > 0) {
+		fs->sync_interval_ms = interval_ms;
+	}
+	pthread_mutex_unlock(&fs->meta_lock);
+	return 0;
+}
+
+/* Charges the calling thread's I/O to client */
+int fs_set_client( int client ) {
+	return disk_set_client(client);
+}
+
+struct agroups *fs_agroups( struct fs *fs ) {
+	return fs->groups;
+}
+
+/* Counts the blocks and extents of the chain from block; the caller
+   holds meta_lock */
+int chain_extents(struct fs *fs, unsigned int block, int *nblocks) {
+	int extents = 0;
+	unsigned int prev = EOFF;
+	*nblocks = 0;
+	while (is_data_block(fs, block) && *nblocks < fs->nblocks) {
+		if (*nblocks == 0 || block != prev + 1) {
+			extents++;
+		}
+		(*nblocks)++;
+		prev = block;
+		block = fat_get(fs, block);
+	}
+	return extents;
+}
+
+/* The map of the file in slot if it still starts at first, else NULL;
+   the caller holds dir_lock */
+struct filemap *defrag_map(struct fs *fs, int slot, unsigned int first) {
+	pthread_mutex_lock(&fs->meta_lock);
+	dir_entry *entry = dir_entry_at(fs, slot);
+	int same = entry->used && entry->first_block == first;
+	pthread_mutex_unlock(&fs->meta_lock);
+	return same ? get_filemap(fs, slot) : NULL;
+}
+
+/* Counts blocks copied against the budget and waits until it allows
+   more; returns TRUE when the defragmenter is asked to stop */
+int defrag_pause(struct fs *fs, int blocks) {
+	pthread_mutex_lock(&fs->defrag_lock);
+	fs->defrag_stats.blocks_copied += blocks;
+	if (fs->defrag_rate > 0) {
+		double now = now_ms();
+		fs->defrag_due_ms = maximum_value(fs->defrag_due_ms, now) + blocks * 1000.0 / fs->defrag_rate;
+		while (!fs->defrag_stop && now < fs->defrag_due_ms) {
+			struct timespec until;
+			long long wait_ns = (long long) ((fs->defrag_due_ms - now) * 1e6);
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += (until.tv_nsec + wait_ns) / 1000000000;
+			until.tv_nsec = (until.tv_nsec + wait_ns) % 1000000000;
+			pthread_cond_timedwait(&fs->defrag_cond, &fs->defrag_lock, &until);
+			now = now_ms();
+		}
+	}
+	int stop = fs->defrag_stop;
+	pthread_mutex_unlock(&fs->defrag_lock);
+	return stop;
+}
+
+/* Copies the n blocks of the file in slot from old to new, a chunk at
+   a time under the map's read lock so readers carry on. Returns FALSE
+   when the file changed or the defragmenter was stopped */
+int defrag_copy(struct fs *fs, int slot, unsigned int version, unsigned int *old, unsigned int *new, int n) {
+	char *buf = bufpool_get(BUFPOOL_MAX_BLOCKS);
+	int done = 0, ok = TRUE;
+
+	while (ok && done < n) {
+		int from = done;
+		int end = minimum_value(n, done + DEFRAG_CHUNK_BLOCKS);
+		pthread_rwlock_rdlock(&fs->dir_lock);
+		struct filemap *map = defrag_map(fs, slot, old[0]);
+		if (map != NULL) {
+			pthread_rwlock_rdlock(&map->lock);
+			ok = (map->version == version);
+			while (ok && done < end) {
+				int run = 1;
+				while (done + run < end && run < BUFPOOL_MAX_BLOCKS &&
+				       old[done + run] == old[done] + run && new[done + run] == new[done] + run) {
+					run++;
+				}
+				disk_read_blocks(fs->disk, old[done], run, buf);
+				disk_write_blocks(fs->disk, new[done], run, buf);
+				done += run;
+			}
+			pthread_rwlock_unlock(&map->lock);
+			put_filemap(fs, map);
+		} else {
+			ok = FALSE;
+		}
+		pthread_rwlock_unlock(&fs->dir_lock);
+
+		if (ok && defrag_pause(fs, done - from)) {
+			ok = FALSE;
+		}
+	}
+	bufpool_put(buf, BUFPOOL_MAX_BLOCKS);
+	return ok;
+}
+
+/* Points the file in slot at its copy in new and frees old, committed
+   and made durable with the copy; a file too big for one transaction is
+   switched in several, between them the copy or the old blocks are
+   only unreachable. FALSE if the file changed */
+int defrag_switch(struct fs *fs, int slot, unsigned int version, unsigned int *old, unsigned int *new, int n) {
+	int i, ok = FALSE;
+
+	__atomic_store_n(&fs->unsynced_data, TRUE, __ATOMIC_RELEASE);
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	struct filemap *map = defrag_map(fs, slot, old[0]);
+	if (map != NULL) {
+		pthread_rwlock_wrlock(&map->lock);
+		if (map->version == version && map->nblocks == n && map->dirty_len == 0) {
+			pthread_mutex_lock(&fs->meta_lock);
+			for (i = n - 1; i >= 0; i--) {
+				fat_set(fs, new[i], (i + 1 < n) ? new[i + 1] : EOFF);
+				journal_split(fs);
+			}
+			set_link(fs, slot, EOFF, new[0]);
+			for (i = 0; i < n; i++) {
+				fat_set(fs, old[i], FREE);
+				journal_split(fs);
+			}
+			memcpy(map->blocks, new, n * sizeof(unsigned int));
+			map->version = __atomic_add_fetch(&fs->map_versions, 1, __ATOMIC_RELAXED);
+			agroups_release(fs->groups, slot);
+			commit_group(fs);
+			pthread_mutex_unlock(&fs->meta_lock);
+			ok = TRUE;
+		}
+		pthread_rwlock_unlock(&map->lock);
+		put_filemap(fs, map);
+	}
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return ok;
+}
+
+/* Moves the file in slot, whose chain starts at first and has extents
+   extents, into fewer. Returns its extents afterwards, 0 if it stayed */
+int defrag_file(struct fs *fs, int slot, unsigned int first, int extents) {
+	int n, i, found = 0, new_extents = 0;
+	unsigned int version;
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	struct filemap *map = defrag_map(fs, slot, first);
+	if (map == NULL) {
+		pthread_rwlock_unlock(&fs->dir_lock);
+		return 0;
+	}
+	pthread_rwlock_rdlock(&map->lock);
+	n = (map->dirty_len == 0) ? map->nblocks : 0;
+	version = map->version;
+	unsigned int *old = malloc(maximum_value(n, 1) * sizeof(unsigned int));
+	memcpy(old, map->blocks, n * sizeof(unsigned int));
+	pthread_rwlock_unlock(&map->lock);
+	put_filemap(fs, map);
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	/* a new place, only worth it in fewer extents */
+	unsigned int *new = malloc(maximum_value(n, 1) * sizeof(unsigned int));
+	while (found < n && new_extents < extents) {
+		int len;
+		int start = agroups_alloc(fs->groups, -1, found ? (int) new[found - 1] + 1 : -1, n - found, &len);
+		if (start < 0) {
+			break;
+		}
+		if (found == 0 || start != new[found - 1] + 1) {
+			new_extents++;
+		}
+		for (i = 0; i < len; i++) {
+			new[found++] = start + i;
+		}
+	}
+
+	int moved = n > 0 && found == n && new_extents < extents &&
+		defrag_copy(fs, slot, version, old, new, n) &&
+		defrag_switch(fs, slot, version, old, new, n);
+	if (!moved) {
+		for (i = 0; i < found; i++) {
+			agroups_set_free(fs->groups, new[i]);
+		}
+	}
+	free(old);
+	free(new);
+	return moved ? new_extents : 0;
+}
+
+/* One pass over the directory, moving every fragmented file found */
+void *defrag_thread(void *arg) {
+	struct fs *fs = arg;
+	int slot;
+
+	for (slot = 0; ; slot++) {
+		pthread_mutex_lock(&fs->meta_lock);
+		if (slot >= fs->ndir_blocks * N_DIR_ENTRIES) {
+			pthread_mutex_unlock(&fs->meta_lock);
+			break;
+		}
+		dir_entry *entry = dir_entry_at(fs, slot);
+		int used = entry->used, nblocks = 0, extents = 0;
+		unsigned int first = entry->first_block;
+		if (used) {
+			extents = chain_extents(fs, first, &nblocks);
+		}
+		pthread_mutex_unlock(&fs->meta_lock);
+
+		int moved = (extents > 1) ? defrag_file(fs, slot, first, extents) : 0;
+
+		pthread_mutex_lock(&fs->defrag_lock);
+		fs->defrag_stats.files_scanned += used;
+		if (extents > 1) {
+			fs->defrag_stats.files_fragmented++;
+			if (moved) {
+				fs->defrag_stats.files_moved++;
+				fs->defrag_stats.extents_before += extents;
+				fs->defrag_stats.extents_after += moved;
+			} else {
+				fs->defrag_stats.files_skipped++;
+			}
+		}
+		int stop = fs->defrag_stop;
+		pthread_mutex_unlock(&fs->defrag_lock);
+		if (stop) {
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&fs->defrag_lock);
+	fs->defrag_stats.running = FALSE;
+	pthread_mutex_unlock(&fs->defrag_lock);
+	return NULL;
+}
+
+/* Starts a pass of the defragmenter, or sets the budget of the one
+   running */
+int fs_defrag_start( struct fs *fs, int kbps ) {
+	if (!is_mounted(fs)) {
+		printf("%s\n", UNMOUNT_DISK_ERROR);
+		return -1;
+	}
+	if (!fs->journal_active) {
+		printf("%s\n", DEFRAG_NEEDS_JOURNAL);
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->defrag_lock);
+	fs->defrag_rate = maximum_value(kbps, 0) / (DISK_BLOCK_SIZE / 1024);
+	if (kbps > 0 && fs->defrag_rate == 0) {
+		fs->defrag_rate = 1;
+	}
+	if (fs->defrag_stats.running) {
+		pthread_mutex_unlock(&fs->defrag_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&fs->defrag_lock);
+
+	/* joins the thread of a pass that finished */
+	fs_defrag_stop(fs);
+	pthread_mutex_lock(&fs->defrag_lock);
+	memset(&fs->defrag_stats, 0, sizeof(fs->defrag_stats));
+	fs->defrag_stats.running = TRUE;
+	fs->defrag_due_ms = 0;
+	fs->defrag_stop = FALSE;
+	fs->defrag_joinable = TRUE;
+	pthread_create(&fs->defrag_thread, NULL, defrag_thread, fs);
+	pthread_mutex_unlock(&fs->defrag_lock);
+	return 0;
+}
+
+/* Stops the defragmenter, leaving the file it was copying as it was */
+int fs_defrag_stop( struct fs *fs ) {
+	pthread_mutex_lock(&fs->defrag_lock);
+	int joinable = fs->defrag_joinable;
+	fs->defrag_stop = TRUE;
+	fs->defrag_joinable = FALSE;
+	pthread_cond_broadcast(&fs->defrag_cond);
+	pthread_mutex_unlock(&fs->defrag_lock);
+	if (joinable) {
+		pthread_join(fs->defrag_thread, NULL);
+	}
+	return 0;
+}
+
+int fs_defrag_get_stats( struct fs *fs, fs_defrag_stats *stats ) {
+	pthread_mutex_lock(&fs->defrag_lock);
+	*stats = fs->defrag_stats;
+	pthread_mutex_unlock(&fs->defrag_lock);
+	return 0;
+}
+
+/* Checks the superblock fields against each other and the disk, fixing
+   in memory the ones that can be worked out again; FALSE when the disk
+   cannot be checked at all */
+int check_superblock(struct fs *fs, fs_check_report *report) {
+	super_block *mb = &fs->mb;
+	if (!is_magic_valid(mb->magic)) {
+		printf("%s\n", MISMATCH_MAGICNO);
+		return FALSE;
+	}
+	if (mb->nblocks <= DIRBLOCK_NUM + 2 || mb->nblocks > disk_size(fs->disk)) {
+		printf("superblock: %d blocks on a disk of %d\n", mb->nblocks, disk_size(fs->disk));
+		return FALSE;
+	}
+	int nfatblocks = up_rounded_division(mb->nblocks, (int) N_ADDRESSES_PER_BLOCK);
+	if (mb->nfatblocks != nfatblocks) {
+		printf("superblock: %d blocks for file allocation table, should be %d\n", mb->nfatblocks, nfatblocks);
+		mb->nfatblocks = nfatblocks;
+		report->bad_superblock++;
+	}
+	if (mb->magic == FS_MAGIC || mb->magic == FS_MAGIC_V3) {
+		int journal_blocks = journal_size(mb->nblocks, nfatblocks);
+		if (mb->journal_start != 2 + nfatblocks || mb->journal_blocks != journal_blocks) {
+			printf("superblock: journal of %d blocks at %d, should be %d at %d\n",
+				mb->journal_blocks, mb->journal_start, journal_blocks, 2 + nfatblocks);
+			mb->journal_start = 2 + nfatblocks;
+			mb->journal_blocks = journal_blocks;
+			report->bad_superblock++;
+		}
+	}
+	if (mb->fat_region_blocks != 0 && mb->fat_region_blocks != up_rounded_division(nfatblocks, FAT_LAZY_REGIONS)) {
+		printf("superblock: cannot tell which fat regions are written\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Runs work on items 0 .. nitems - 1, spread over FSCK_THREADS threads */
+void *fsck_thread(void *arg) {
+	struct fsck *check = arg;
+	int item;
+	while ((item = __atomic_fetch_add(&check->next, 1, __ATOMIC_RELAXED)) < check->nitems) {
+		check->work(check, item);
+	}
+	return NULL;
+}
+
+void fsck_parallel(struct fsck *check, void (*work)(struct fsck *check, int item), int nitems) {
+	pthread_t threads[FSCK_THREADS];
+	int i;
+	check->work = work;
+	check->nitems = nitems;
+	check->next = 0;
+	for (i = 0; i < FSCK_THREADS; i++) {
+		pthread_create(&threads[i], NULL, fsck_thread, check);
+	}
+	for (i = 0; i < FSCK_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+/* Marks block reached by a chain, FALSE if something reached it first */
+int fsck_reach(struct fsck *check, unsigned int block) {
+	unsigned long bit = 1UL << (block % WORD_BITS);
+	return !(__atomic_fetch_or(&check->reached[block / WORD_BITS], bit, __ATOMIC_RELAXED) & bit);
+}
+
+int fsck_reached(struct fsck *check, unsigned int block) {
+	return (check->reached[block / WORD_BITS] >> (block % WORD_BITS)) & 1;
+}
+
+/* Reads fat blocks item * FSCK_FAT_CHUNK on in runs; unwritten ones are
+   left zero, all free */
+void fsck_read_fat(struct fsck *check, int item) {
+	struct fs *fs = check->fs;
+	int b = item * FSCK_FAT_CHUNK;
+	int end = minimum_value(b + FSCK_FAT_CHUNK, fs->nfatblocks);
+	while (b < end) {
+		int run = 1;
+		if (is_fat_lazy(fs, b)) {
+			b++;
+			continue;
+		}
+		while (b + run < end && !is_fat_lazy(fs, b + run)) {
+			run++;
+		}
+		disk_read_blocks(fs->disk, 2 + b, run, (char *) check->fat + (long) b * DISK_BLOCK_SIZE);
+		b += run;
+	}
+}
+
+/* Takes block for the chain of rank unless a lower rank has it; FALSE
+   once it is held by rank or a lower one, the walk stops there */
+int fsck_claim(struct fsck *check, unsigned int block, unsigned int rank) {
+	unsigned int owner = __atomic_load_n(&check->owner[block], __ATOMIC_RELAXED);
+	do {
+		if (owner != 0 && owner <= rank) {
+			return FALSE;
+		}
+	} while (!__atomic_compare_exchange_n(&check->owner[block], &owner, rank, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return TRUE;
+}
+
+/* Claims the blocks the chains of slots item * FSCK_SLOT_CHUNK on reach.
+   A walk stops where a lower rank already was, which walks on from
+   there itself, so once all are done every block is owned by the
+   lowest slot reaching it, however the threads ran */
+void fsck_own(struct fsck *check, int item) {
+	int slot = item * FSCK_SLOT_CHUNK;
+	int end = minimum_value(slot + FSCK_SLOT_CHUNK, check->nslots);
+	for (; slot < end; slot++) {
+		unsigned int block = check->entries[slot].first_block;
+		if (!check->entries[slot].used) {
+			continue;
+		}
+		while (is_data_block(check->fs, block) && fsck_claim(check, block, owner_rank(slot))) {
+			block = check->fat[block];
+		}
+	}
+}
+
+/* Walks the chains of slots item * FSCK_SLOT_CHUNK on, up to the first
+   link that leaves the data blocks, runs into a block owned by another
+   chain or comes back to one of its own */
+void fsck_walk(struct fsck *check, int item) {
+	int slot = item * FSCK_SLOT_CHUNK;
+	int end = minimum_value(slot + FSCK_SLOT_CHUNK, check->nslots);
+	for (; slot < end; slot++) {
+		chain_check *chain = &check->chains[slot];
+		unsigned int block = check->entries[slot].first_block;
+		chain->nblocks = 0;
+		chain->last = EOFF;
+		chain->end = CHAIN_OK;
+		if (!check->entries[slot].used) {
+			continue;
+		}
+		while (block != EOFF) {
+			if (block < check->data_start || block >= (unsigned int) check->fs->nblocks) {
+				chain->end = CHAIN_BAD_LINK;
+				break;
+			}
+			if (check->owner[block] != owner_rank(slot)) {
+				chain->end = CHAIN_MEETS;
+				chain->met = block;
+				break;
+			}
+			if (!fsck_reach(check, block)) {
+				chain->end = CHAIN_CYCLE;
+				chain->met = block;
+				break;
+			}
+			chain->nblocks++;
+			chain->last = block;
+			block = check->fat[block];
+		}
+	}
+}
+
+/* Counts the data blocks among fat entries item * FSCK_SCAN_CHUNK on
+   that are in use but reached by no chain */
+void fsck_scan(struct fsck *check, int item) {
+	unsigned int block = maximum_value((unsigned int) item * FSCK_SCAN_CHUNK, check->data_start);
+	unsigned int end = minimum_value((unsigned int) (item + 1) * FSCK_SCAN_CHUNK, (unsigned int) check->fs->nblocks);
+	int leaked = 0;
+	for (; block < end; block++) {
+		if (check->fat[block] != FREE && !fsck_reached(check, block)) {
+			leaked++;
+		}
+	}
+	__atomic_add_fetch(&check->leaked, leaked, __ATOMIC_RELAXED);
+}
+
+/* Loads the directory of a disk fs_check must not write to: the fat
+   read gets the journal's committed transactions, the directory is
+   found through it and read, then gets their directory records */
+void fsck_load(struct fsck *check) {
+	struct fs *fs = check->fs;
+	journal_replay replay;
+	int b, i;
+
+	memset(&replay, 0, sizeof(replay));
+	replay.fs = fs;
+	replay.fat = check->fat;
+	if (fs->mb.journal_blocks > 0) {
+		read_journal(&replay);
+	}
+	find_dir_blocks(fs, check->fat);
+
+	check->nslots = fs->ndir_blocks * N_DIR_ENTRIES;
+	check->entries = malloc(check->nslots * sizeof(dir_entry));
+	char *block = bufpool_get(1);
+	for (b = 0; b < fs->ndir_blocks; b++) {
+		disk_read(fs->disk, fs->dir_blocks[b], block);
+		memcpy(&check->entries[b * N_DIR_ENTRIES], block, N_DIR_ENTRIES * sizeof(dir_entry));
+	}
+	bufpool_put(block, 1);
+	for (i = 0; i < replay.ndir; i++) {
+		if (replay.dir_records[i].index < check->nslots) {
+			check->entries[replay.dir_records[i].index] = replay.dir_records[i].u.entry;
+		}
+	}
+	free(replay.dir_records);
+}
+
+/* Checks the fat entries of the metadata blocks, busy but for the first
+   directory block's, and that the directory chain ends; the directory
+   blocks count as reached */
+void check_metadata(struct fsck *check, int repair, fs_check_report *report) {
+	struct fs *fs = check->fs;
+	unsigned int b;
+	for (b = 0; b < check->data_start; b++) {
+		if (b != DIRBLOCK_NUM && check->fat[b] != BUSY) {
+			printf("fat entry %u of a metadata block is %u\n", b, check->fat[b]);
+			report->bad_metadata++;
+			if (repair) {
+				fat_set(fs, b, BUSY);
+				journal_split(fs);
+			}
+		}
+	}
+
+	int i;
+	for (i = 1; i < fs->ndir_blocks; i++) {
+		check->owner[fs->dir_blocks[i]] = OWNER_DIR;
+		fsck_reach(check, fs->dir_blocks[i]);
+	}
+	unsigned int last = fs->dir_blocks[fs->ndir_blocks - 1];
+	unsigned int end = (last == DIRBLOCK_NUM) ? BUSY : EOFF;
+	if (check->fat[last] != EOFF && check->fat[last] != BUSY) {
+		printf("directory chain runs on after block %u\n", last);
+		report->bad_metadata++;
+		if (repair) {
+			fat_set(fs, last, end);
+		}
+	}
+}
+
+/* Reports what went wrong with the chain of slot and, with repair, cuts
+   it there and cuts the length to what is left */
+void check_chain(struct fsck *check, int slot, int repair, fs_check_report *report) {
+	struct fs *fs = check->fs;
+	chain_check *chain = &check->chains[slot];
+	dir_entry *entry = &check->entries[slot];
+	int needed = up_rounded_division((long long) entry->length, DISK_BLOCK_SIZE);
+
+	if (chain->end == CHAIN_BAD_LINK) {
+		printf("file \"%s\": chain leaves the data blocks after %d blocks\n", entry->name, chain->nblocks);
+		report->bad_links++;
+	} else if (chain->end == CHAIN_CYCLE) {
+		printf("file \"%s\": chain meets itself after %d blocks\n", entry->name, chain->nblocks);
+		report->cycles++;
+	} else if (chain->end == CHAIN_MEETS) {
+		printf("file \"%s\": chain runs into block %u of another file or the directory\n", entry->name, chain->met);
+		report->cross_links++;
+	}
+	if (chain->nblocks < needed) {
+		printf("file \"%s\": %u bytes in %d blocks\n", entry->name, entry->length, chain->nblocks);
+		report->bad_lengths++;
+	}
+	if (!repair) {
+		return;
+	}
+
+	if (chain->end != CHAIN_OK) {
+		set_link(fs, slot, chain->last, EOFF);
+	}
+	if (chain->nblocks < needed) {
+		dir_entry *on_disk = dir_entry_at(fs, slot);
+		on_disk->length = chain->nblocks * DISK_BLOCK_SIZE;
+		mark_dir_entry(fs, slot, on_disk);
+	}
+}
+
+/* Checks an unmounted disk, see fs.h */
+int fs_check( struct fs *fs, int repair, fs_check_report *report ) {
+	if (is_mounted(fs)) {
+		printf("%s\n", CANT_CHECK_MOUNTED);
+		return -1;
+	}
+	memset(report, 0, sizeof(fs_check_report));
+	read_superblock_from_disk(fs);
+	if (!check_superblock(fs, report)) {
+		fs->mb.magic = 0;
+		return -1;
+	}
+	if (report->bad_superblock > 0 && !repair) {
+		fs->mb.magic = 0;
+		return report->bad_superblock;
+	}
+	if (repair) {
+		/* with the fields fixed, and a free count the mount recomputes */
+		fs->mb.clean_seq = 0;
+		write_superblock_to_disk(fs);
+		disk_sync(fs->disk);
+		fs->mb.magic = 0;
+		if (fs_mount(fs) < 0) {
+			return -1;
+		}
+		/* the mount replayed the journal, what is on disk is current */
+	} else {
+		fs->nblocks = fs->mb.nblocks;
+		fs->nfatblocks = fs->mb.nfatblocks;
+	}
+
+	struct fsck check;
+	memset(&check, 0, sizeof(check));
+	check.fs = fs;
+	check.data_start = 2 + fs->nfatblocks + fs->mb.journal_blocks;
+	check.fat = (unsigned int *) bufpool_alloc((long) fs->nfatblocks * DISK_BLOCK_SIZE);
+	check.owner = calloc(fs->nblocks, sizeof(unsigned int));
+	check.reached = calloc(up_rounded_division(fs->nblocks, (int) WORD_BITS), sizeof(unsigned long));
+	fsck_parallel(&check, fsck_read_fat, up_rounded_division(fs->nfatblocks, FSCK_FAT_CHUNK));
+
+	int slot;
+	pthread_mutex_lock(&fs->meta_lock);
+	if (repair) {
+		check.nslots = fs->ndir_blocks * N_DIR_ENTRIES;
+		check.entries = malloc(check.nslots * sizeof(dir_entry));
+		for (slot = 0; slot < check.nslots; slot++) {
+			check.entries[slot] = *dir_entry_at(fs, slot);
+		}
+	} else {
+		fsck_load(&check);
+	}
+	check.chains = malloc(check.nslots * sizeof(chain_check));
+	check_metadata(&check, repair, report);
+	pthread_mutex_unlock(&fs->meta_lock);
+
+	fsck_parallel(&check, fsck_own, up_rounded_division(check.nslots, FSCK_SLOT_CHUNK));
+	fsck_parallel(&check, fsck_walk, up_rounded_division(check.nslots, FSCK_SLOT_CHUNK));
+	pthread_mutex_lock(&fs->meta_lock);
+	for (slot = 0; slot < check.nslots; slot++) {
+		if (check.entries[slot].used) {
+			report->files++;
+			check_chain(&check, slot, repair, report);
+			if (repair) {
+				journal_split(fs);
+			}
+		}
+	}
+	pthread_mutex_unlock(&fs->meta_lock);
+
+	/* blocks past a cut are reached by nothing and freed with the rest */
+	fsck_parallel(&check, fsck_scan, up_rounded_division(fs->nblocks, FSCK_SCAN_CHUNK));
+	report->leaked_blocks = check.leaked;
+	if (check.leaked > 0) {
+		printf("%d blocks in use by no file\n", check.leaked);
+	}
+	if (repair) {
+		pthread_mutex_lock(&fs->meta_lock);
+		unsigned int block;
+		for (block = check.data_start; check.leaked > 0 && block < (unsigned int) fs->nblocks; block++) {
+			if (check.fat[block] != FREE && !fsck_reached(&check, block)) {
+				fat_set(fs, block, FREE);
+				journal_split(fs);
+			}
+		}
+		commit_metadata(fs);
+		pthread_mutex_unlock(&fs->meta_lock);
+	}
+
+	bufpool_free(check.fat, (long) fs->nfatblocks * DISK_BLOCK_SIZE);
+	free(check.owner);
+	free(check.reached);
+	free(check.entries);
+	free(check.chains);
+
+	int problems = report->bad_superblock + report->bad_links + report->cycles + report->cross_links +
+		report->bad_lengths + report->leaked_blocks + report->bad_metadata;
+	report->repaired = repair && problems > 0;
+	if (repair) {
+		write_back(fs);
+	}
+	fs->mb.magic = 0;
+	return problems;
+}
+
+/* Entry b of the fat read by fs_debug, or the cached one when fat is NULL */
+unsigned int debug_fat(struct fs *fs, const unsigned int *fat, int b) {
+	return (fat != NULL) ? fat[b] : fat_get(fs, b);
+}
+
+/* Prints a debug message. An unmounted disk is only read: the fat and
+   directory are loaded with the journal applied as fs_check does, the
+   fat regions never written reading as free */
+void fs_debug(struct fs *fs) {
+	
+	int current_magic = fs->mb.magic;
+	int mounted = is_mounted(fs);
+	struct fsck check;
+	memset(&check, 0, sizeof(check));
+	check.fs = fs;
+	
+	if(!mounted) {
+		read_superblock_from_disk(fs);
+		if(!is_magic_valid(fs->mb.magic)) {
+			printf("%s\n", MISMATCH_MAGICNO);
+			fs->mb.magic = current_magic;
+			return;
+		} else {
+			printf("%s\n", "superblock:");
+			printf("%s\n", UNMOUNT_DISK_ERROR);
+		}
+		fs->nblocks = fs->mb.nblocks;
+		fs->nfatblocks = fs->mb.nfatblocks;
+		check.fat = (unsigned int *) bufpool_alloc((long) fs->nfatblocks * DISK_BLOCK_SIZE);
+		fsck_parallel(&check, fsck_read_fat, up_rounded_division(fs->nfatblocks, FSCK_FAT_CHUNK));
+		fsck_load(&check);
+	} else {
+		pthread_rwlock_rdlock(&fs->dir_lock);
+		pthread_mutex_lock(&fs->meta_lock);
+		printf("%s\n", "superblock:");
+		printf("%s\n", MATCHING_MAGICNO);
+	}
+	
+	printf("%d%s\n", fs->mb.nblocks, "blocks on disk");
+	printf("%d%s\n", fs->mb.nfatblocks ,"blocks for file allocation table");
+	printf("%d%s\n", fs->ndir_blocks, "blocks for directory");
+	printf("%d%s\n", fs->mb.journal_blocks, "blocks for journal");
+	if(current_magic == FS_MAGIC) {
+		printf("%d%s\n", agroups_free(fs->groups) + fs->npending_free, "blocks free");
+		printf("%d%s\n", agroups_count(fs->groups), "allocation groups");
+		agroups_stats stats;
+		agroups_get_stats(fs->groups, &stats);
+		printf("%d%s\n", stats.loaded, "allocation groups loaded");
+	}
+
+	int i, files = 0, extents = 0;
+	for(i = 0; i < fs->ndir_blocks * N_DIR_ENTRIES; i++) {
+		dir_entry *entry = mounted ? dir_entry_at(fs, i) : &check.entries[i];
+		if(entry->used) {
+			printf("%s%s%s\n", "File \"", entry->name, "\":" );
+			printf("%s%d%s\n", "\tsize:", entry->length, " bytes");
+			int fat_index = entry->first_block;
+			int file_extents = 0, steps = 0;
+			if (is_data_block(fs, fat_index)) {
+				printf("blocks: ");
+				do {
+					/* a new extent starts wherever the chain jumps */
+					if (file_extents == 0 || debug_fat(fs, check.fat, fat_index - 1) != fat_index) {
+						file_extents++;
+					}
+					printf("%d ", fat_index);
+					fat_index = debug_fat(fs, check.fat, fat_index);
+				} while (fat_index != EOFF && is_data_block(fs, fat_index) && ++steps < fs->nblocks);
+				if (fat_index != EOFF) {
+					/* a broken or endless chain, see fs_check */
+					printf("...");
+				}
+				printf("\n");
+			}
+			printf("%s%d\n", "\textents:", file_extents);
+			files++;
+			extents += file_extents;
+		}
+	}
+	if (files > 0) {
+		printf("%d files in %d extents, %.2f extents per file\n", files, extents, (double) extents / files);
+	}
+	
+	fs->mb.magic = current_magic;
+	if(mounted) {
+		pthread_mutex_unlock(&fs->meta_lock);
+		pthread_rwlock_unlock(&fs->dir_lock);
+	} else {
+		bufpool_free(check.fat, (long) fs->nfatblocks * DISK_BLOCK_SIZE);
+		free(check.entries);
+	}
+	
+//	print_fat();
+}
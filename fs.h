@@ -1,15 +1,119 @@
 #ifndef FS_H
 #define FS_H
 
-void fs_debug();
-int  fs_format();
-int  fs_mount();
+struct disk;
 
-int  fs_create( char *name);
-int  fs_delete( char *name );
-int  fs_getsize( char *name);
+/* A filesystem handle bound to one disk; handles on different disks are
+   independent and may be used from different threads. Once mounted, one
+   handle may also be shared: calls on different files run in parallel,
+   reads of the same file too. fs_format, fs_mount and fs_destroy must
+   not overlap other calls, and a descriptor's cursor belongs to one
+   thread at a time */
+struct fs;
 
-int  fs_read( char *name, char *data, int length, int offset );
-int  fs_write( char *name, const char *data, int length, int offset );
+struct fs *fs_init( struct disk *disk );
+void fs_destroy( struct fs *fs );
+
+void fs_debug( struct fs *fs );
+int  fs_format( struct fs *fs );
+int  fs_mount( struct fs *fs );
+
+int  fs_create( struct fs *fs, char *name);
+int  fs_delete( struct fs *fs, char *name );
+int  fs_getsize( struct fs *fs, char *name);
+int  fs_free_blocks( struct fs *fs );
+
+int  fs_read( struct fs *fs, char *name, char *data, int length, int offset );
+int  fs_write( struct fs *fs, char *name, const char *data, int length, int offset );
+
+/* fs_fallocate reserves blocks for a file's first length bytes, in one
+   extent where the disk allows, without writing them or changing its
+   length. fs_truncate sets the length, freeing the blocks past it, so
+   it also gives back what fs_fallocate reserved. When the blocks do not
+   all fit, either call fails and keeps none of them */
+int  fs_fallocate( struct fs *fs, char *name, int length );
+int  fs_truncate( struct fs *fs, char *name, int length );
+
+/* Open files: descriptors cache the directory slot and block map of
+   the file; fs_fread and fs_fwrite work at a cursor that fs_seek sets.
+   Appends through a descriptor are buffered and reach the disk on
+   fs_close, fs_sync or when the buffers fill up. Metadata changes are
+   journaled and committed in groups; fs_sync commits the pending ones
+   at once */
+int  fs_open( struct fs *fs, char *name );
+int  fs_close( struct fs *fs, int fd );
+int  fs_pread( struct fs *fs, int fd, char *data, int length, int offset );
+int  fs_pwrite( struct fs *fs, int fd, const char *data, int length, int offset );
+int  fs_fread( struct fs *fs, int fd, char *data, int length );
+int  fs_fwrite( struct fs *fs, int fd, const char *data, int length );
+int  fs_seek( struct fs *fs, int fd, int offset );
+int  fs_sync( struct fs *fs );
+
+/* When changes become durable:
+   NONE      never forced, the host flushes whenever it likes
+   OP        before each create, delete or write returns
+   PERIODIC  at the first operation ending interval_ms after the last sync
+   BARRIER   at fs_sync and fs_destroy, the default
+   A sync makes the data durable, then commits the metadata that points
+   to it and makes that durable; syncs that overlap share one fdatasync.
+   Between syncs metadata is still committed in groups, so a crash
+   leaves it consistent at some recent point */
+#define FS_DURABLE_NONE     0
+#define FS_DURABLE_OP       1
+#define FS_DURABLE_PERIODIC 2
+#define FS_DURABLE_BARRIER  3
+int  fs_set_durability( struct fs *fs, int mode, int interval_ms );
+
+int  fs_set_client( int client );
+
+/* Online defragmentation: a background thread walks the fat for files
+   in more than one extent, copies each into fewer free extents while
+   the file stays in use, and switches its chain over in one journal
+   transaction, dropping the copy if the file changed meanwhile. At
+   most kbps KiB/s are copied, 0 for no limit; starting it again while
+   it runs only changes the limit. Needs a journaled filesystem */
+typedef struct {
+	int running;
+	int files_scanned;
+	int files_fragmented;
+	int files_moved;
+	int files_skipped;		/* changed while copied, or no better place */
+	long long blocks_copied;
+	long long extents_before;	/* of the files moved */
+	long long extents_after;
+} fs_defrag_stats;
+
+int  fs_defrag_start( struct fs *fs, int kbps );
+int  fs_defrag_stop( struct fs *fs );
+int  fs_defrag_get_stats( struct fs *fs, fs_defrag_stats *stats );
+
+/* Checks an unmounted disk: the superblock, then that every file's
+   chain ends in EOFF without running off the data blocks, into itself
+   or into another file or the directory, and holds the file's length,
+   and that no block is in use outside the chains. The fat is read and
+   the chains walked by several threads; a block several chains reach
+   stays with the lowest directory slot among them, or the directory,
+   so the outcome does not depend on how the threads ran. Without repair the disk is only read, the journal's committed
+   transactions applied in memory. With repair it is mounted, which
+   replays the journal, then chains are cut where they go wrong, lengths
+   cut to the blocks left and blocks in use by no file freed, through
+   the journal. Returns the number of problems found, -1 if the disk
+   cannot be checked */
+typedef struct {
+	int files;
+	int bad_superblock;	/* fields that disagree */
+	int bad_links;		/* chains leaving the data blocks */
+	int cycles;
+	int cross_links;	/* chains running into another file or the directory */
+	int bad_lengths;	/* files longer than their chains */
+	int leaked_blocks;	/* in use by no file */
+	int bad_metadata;	/* fat entries of the metadata, the directory chain */
+	int repaired;
+} fs_check_report;
+
+int  fs_check( struct fs *fs, int repair, fs_check_report *report );
+
+/* Allocation groups of the mounted filesystem, see agroup.h */
+struct agroups *fs_agroups( struct fs *fs );
 
 #endif
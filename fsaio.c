@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "fsaio.h"
+#include "qos.h"
+
+#define AIO_READ_PIECE (256 << 10)	/* bytes per piece of a large read */
+
+#define OP_CREATE 0
+#define OP_DELETE 1
+#define OP_READ   2
+#define OP_WRITE  3
+#define OP_OPEN   4
+#define OP_CLOSE  5
+#define OP_PREAD  6
+#define OP_PWRITE 7
+#define OP_SYNC   8
+
+typedef struct request {
+	int op;
+	char *name;		/* a copy, owned by the request */
+	int fd;
+	char *data;
+	int length, offset;
+	int client;
+	fs_aio_callback callback;
+	void *arg;
+	int result;
+
+	/* a large read is queued as pieces; the pieces point at the read,
+	   which completes when its last piece does */
+	struct request *parent;
+	int pieces;
+
+	struct request *next;
+} request;
+
+struct fs_aio {
+	struct fs *fs;
+	pthread_t *threads;
+	int nthreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued;		/* work for the I/O threads, or stop */
+	pthread_cond_t completed;	/* something done for fs_aio_wait */
+	request *head, *tail;		/* waiting for an I/O thread */
+	request *done_head, *done_tail;	/* waiting for their callbacks */
+	int ndone;
+	int inflight;
+	int stop;
+
+	/* a byte sits in the pipe while done is not empty */
+	int pipe[2];
+	int signalled;
+};
+
+static int run( struct fs *fs, request *req )
+{
+	switch(req->op) {
+	case OP_CREATE: return fs_create(fs, req->name);
+	case OP_DELETE: return fs_delete(fs, req->name);
+	case OP_READ:   return fs_read(fs, req->name, req->data, req->length, req->offset);
+	case OP_WRITE:  return fs_write(fs, req->name, req->data, req->length, req->offset);
+	case OP_OPEN:   return fs_open(fs, req->name);
+	case OP_CLOSE:  return fs_close(fs, req->fd);
+	case OP_PREAD:  return fs_pread(fs, req->fd, req->data, req->length, req->offset);
+	case OP_PWRITE: return fs_pwrite(fs, req->fd, req->data, req->length, req->offset);
+	case OP_SYNC:   return fs_sync(fs);
+	}
+	return -1;
+}
+
+/* Moves req to the done list and wakes whoever waits for it; the
+   caller holds the lock */
+static void complete( struct fs_aio *aio, request *req )
+{
+	req->next = NULL;
+	if(aio->done_tail) aio->done_tail->next = req;
+	else aio->done_head = req;
+	aio->done_tail = req;
+	aio->ndone++;
+
+	if(!aio->signalled) {
+		char byte = 1;
+		if(write(aio->pipe[1], &byte, 1) == 1) aio->signalled = 1;
+	}
+	pthread_cond_broadcast(&aio->completed);
+}
+
+/* Records the result of req; a piece of a read adds to the read, where
+   a piece past the end of the file counts as nothing read */
+static void finish( struct fs_aio *aio, request *req, int result )
+{
+	request *parent = req->parent;
+
+	if(!parent) {
+		req->result = result;
+		complete(aio, req);
+		return;
+	}
+
+	if(req->offset == parent->offset && result < 0) {
+		parent->result = -1;
+	} else if(parent->result >= 0 && result > 0) {
+		parent->result += result;
+	}
+	free(req);
+	if(--parent->pieces == 0) complete(aio, parent);
+}
+
+static void *io_thread( void *arg )
+{
+	struct fs_aio *aio = arg;
+
+	pthread_mutex_lock(&aio->lock);
+	while(1) {
+		request *req;
+		int result;
+
+		while(!aio->head && !aio->stop) {
+			pthread_cond_wait(&aio->queued, &aio->lock);
+		}
+		if(!aio->head) break;
+
+		req = aio->head;
+		aio->head = req->next;
+		if(!aio->head) aio->tail = NULL;
+		pthread_mutex_unlock(&aio->lock);
+
+		qos_set_client(req->client);
+		result = run(aio->fs, req);
+
+		pthread_mutex_lock(&aio->lock);
+		finish(aio, req, result);
+	}
+	pthread_mutex_unlock(&aio->lock);
+	return NULL;
+}
+
+struct fs_aio *fs_aio_init( struct fs *fs, int nthreads )
+{
+	struct fs_aio *aio = calloc(1, sizeof(struct fs_aio));
+	int i;
+
+	if(pipe(aio->pipe) < 0) {
+		free(aio);
+		return NULL;
+	}
+	fcntl(aio->pipe[0], F_SETFL, O_NONBLOCK);
+
+	aio->fs = fs;
+	aio->nthreads = (nthreads > 0) ? nthreads : 1;
+	pthread_mutex_init(&aio->lock, NULL);
+	pthread_cond_init(&aio->queued, NULL);
+	pthread_cond_init(&aio->completed, NULL);
+
+	aio->threads = malloc(aio->nthreads * sizeof(pthread_t));
+	for(i = 0; i < aio->nthreads; i++) {
+		pthread_create(&aio->threads[i], NULL, io_thread, aio);
+	}
+	return aio;
+}
+
+void fs_aio_destroy( struct fs_aio *aio )
+{
+	int i;
+
+	if(!aio) return;
+	while(fs_aio_inflight(aio) > 0) fs_aio_wait(aio, 1);
+
+	pthread_mutex_lock(&aio->lock);
+	aio->stop = 1;
+	pthread_cond_broadcast(&aio->queued);
+	pthread_mutex_unlock(&aio->lock);
+	for(i = 0; i < aio->nthreads; i++) {
+		pthread_join(aio->threads[i], NULL);
+	}
+
+	close(aio->pipe[0]);
+	close(aio->pipe[1]);
+	pthread_mutex_destroy(&aio->lock);
+	pthread_cond_destroy(&aio->queued);
+	pthread_cond_destroy(&aio->completed);
+	free(aio->threads);
+	free(aio);
+}
+
+/* Queues req, or its pieces when it is a large read */
+static int submit( struct fs_aio *aio, request *req )
+{
+	request *first = req, *last = req;
+
+	req->client = qos_get_client();
+	if((req->op == OP_READ || req->op == OP_PREAD) && req->length > AIO_READ_PIECE) {
+		int done;
+		first = last = NULL;
+		for(done = 0; done < req->length; done += AIO_READ_PIECE) {
+			request *piece = malloc(sizeof(request));
+			*piece = *req;
+			piece->data = req->data + done;
+			piece->offset = req->offset + done;
+			piece->length = (req->length - done < AIO_READ_PIECE) ? req->length - done : AIO_READ_PIECE;
+			piece->parent = req;
+			piece->next = NULL;
+			if(last) last->next = piece;
+			else first = piece;
+			last = piece;
+			req->pieces++;
+		}
+	}
+
+	pthread_mutex_lock(&aio->lock);
+	if(aio->tail) aio->tail->next = first;
+	else aio->head = first;
+	aio->tail = last;
+	aio->inflight++;
+	pthread_cond_broadcast(&aio->queued);
+	pthread_mutex_unlock(&aio->lock);
+	return 0;
+}
+
+static request *new_request( int op, char *name, int fd, const char *data, int length, int offset, fs_aio_callback callback, void *arg )
+{
+	request *req = calloc(1, sizeof(request));
+	req->op = op;
+	req->name = name ? strdup(name) : NULL;
+	req->fd = fd;
+	req->data = (char *)data;
+	req->length = length;
+	req->offset = offset;
+	req->callback = callback;
+	req->arg = arg;
+	return req;
+}
+
+int fs_aio_create( struct fs_aio *aio, char *name, fs_aio_callback callback, void *arg )
+{
+	return submit(aio, new_request(OP_CREATE, name, -1, NULL, 0, 0, callback, arg));
+}
+
+int fs_aio_delete( struct fs_aio *aio, char *name, fs_aio_callback callback, void *arg )
+{
+	return submit(aio, new_request(OP_DELETE, name, -1, NULL, 0, 0, callback, arg));
+}
+
+int fs_aio_read( struct fs_aio *aio, char *name, char *data, int length, int offset, fs_aio_callback callback, void *arg )
+{
+	return submit(aio, new_request(OP_READ, name, -1, data, length, offset, callback, arg));
+}
+
+int fs_aio_write( struct fs_aio *aio, char *name, const char *data, int length, int offset, fs_aio_callback callback, void *arg )
+{
+	return submit(aio, new_request(OP_WRITE, name, -1, data, length, offset, callback, arg));
+}
+
+int fs_aio_open( struct fs_aio *aio, char *name, fs_aio_callback callback, void *arg )
+{
+	return submit(aio, new_request(OP_OPEN, name, -1, NULL, 0, 0, callback, arg));
+}
+
+int fs_aio_close( struct fs_aio *aio, int fd, fs_aio_callback callback, void *arg )
+{
+	return submit(aio, new_request(OP_CLOSE, NULL, fd, NULL, 0, 0, callback, arg));
+}
+
+int fs_aio_pread( struct fs_aio *aio, int fd, char *data, int length, int offset, fs_aio_callback callback, void *arg )
+{
+	return submit(aio, new_request(OP_PREAD, NULL, fd, data, length, offset, callback, arg));
+}
+
+int fs_aio_pwrite( struct fs_aio *aio, int fd, const char *data, int length, int offset, fs_aio_callback callback, void *arg )
+{
+	return submit(aio, new_request(OP_PWRITE, NULL, fd, data, length, offset, callback, arg));
+}
+
+int fs_aio_sync( struct fs_aio *aio, fs_aio_callback callback, void *arg )
+{
+	return submit(aio, new_request(OP_SYNC, NULL, -1, NULL, 0, 0, callback, arg));
+}
+
+int fs_aio_poll( struct fs_aio *aio )
+{
+	request *req, *next;
+	int n = 0;
+
+	pthread_mutex_lock(&aio->lock);
+	req = aio->done_head;
+	aio->done_head = aio->done_tail = NULL;
+	aio->ndone = 0;
+	if(aio->signalled) {
+		char byte;
+		while(read(aio->pipe[0], &byte, 1) == 1);
+		aio->signalled = 0;
+	}
+	pthread_mutex_unlock(&aio->lock);
+
+	/* outside the lock, callbacks may queue more requests */
+	for(; req; req = next) {
+		next = req->next;
+		if(req->callback) req->callback(req->result, req->arg);
+		free(req->name);
+		free(req);
+		n++;
+	}
+
+	if(n > 0) {
+		pthread_mutex_lock(&aio->lock);
+		aio->inflight -= n;
+		pthread_cond_broadcast(&aio->completed);
+		pthread_mutex_unlock(&aio->lock);
+	}
+	return n;
+}
+
+int fs_aio_wait( struct fs_aio *aio, int min )
+{
+	pthread_mutex_lock(&aio->lock);
+	while(aio->ndone < min && aio->ndone < aio->inflight) {
+		pthread_cond_wait(&aio->completed, &aio->lock);
+	}
+	pthread_mutex_unlock(&aio->lock);
+	return fs_aio_poll(aio);
+}
+
+int fs_aio_inflight( struct fs_aio *aio )
+{
+	int n;
+	pthread_mutex_lock(&aio->lock);
+	n = aio->inflight;
+	pthread_mutex_unlock(&aio->lock);
+	return n;
+}
+
+int fs_aio_fd( struct fs_aio *aio )
+{
+	return aio->pipe[0];
+}
@@ -0,0 +1,55 @@
+#ifndef FSAIO_H
+#define FSAIO_H
+
+/* Callback-style filesystem calls over a thread pool. A request is
+   queued and returns at once, and one of the context's I/O threads
+   makes the ordinary blocking fs.h call for it. There is no
+   non-blocking disk path underneath: each request in progress holds a
+   pool thread in pread or pwrite, so no more than nthreads of them
+   reach the disk at a time, whatever the number queued. What it buys
+   is a caller that need not block: requests on different files, and
+   reads of one file, run in parallel on the pool, and large reads are
+   split into pieces that do too. Each request ends with its callback,
+   run by whichever thread calls fs_aio_poll or fs_aio_wait, with what
+   the blocking call would have returned. Requests are charged to the
+   QoS client of the thread that queued them. */
+
+struct fs;
+struct fs_aio;
+
+typedef void (*fs_aio_callback)( int result, void *arg );
+
+/* A context for a mounted filesystem with nthreads I/O threads */
+struct fs_aio *fs_aio_init( struct fs *fs, int nthreads );
+
+/* Waits for every queued request, running their callbacks, and stops
+   the I/O threads */
+void fs_aio_destroy( struct fs_aio *aio );
+
+/* Each queues the fs.h call of the same name and returns 0. Names are
+   copied, data must stay valid until the callback runs */
+int  fs_aio_create( struct fs_aio *aio, char *name, fs_aio_callback callback, void *arg );
+int  fs_aio_delete( struct fs_aio *aio, char *name, fs_aio_callback callback, void *arg );
+int  fs_aio_read( struct fs_aio *aio, char *name, char *data, int length, int offset, fs_aio_callback callback, void *arg );
+int  fs_aio_write( struct fs_aio *aio, char *name, const char *data, int length, int offset, fs_aio_callback callback, void *arg );
+int  fs_aio_open( struct fs_aio *aio, char *name, fs_aio_callback callback, void *arg );
+int  fs_aio_close( struct fs_aio *aio, int fd, fs_aio_callback callback, void *arg );
+int  fs_aio_pread( struct fs_aio *aio, int fd, char *data, int length, int offset, fs_aio_callback callback, void *arg );
+int  fs_aio_pwrite( struct fs_aio *aio, int fd, const char *data, int length, int offset, fs_aio_callback callback, void *arg );
+int  fs_aio_sync( struct fs_aio *aio, fs_aio_callback callback, void *arg );
+
+/* Runs the callbacks of the requests done so far and returns how many */
+int  fs_aio_poll( struct fs_aio *aio );
+
+/* Like fs_aio_poll, but first waits until min requests are done or
+   none are left in flight */
+int  fs_aio_wait( struct fs_aio *aio, int min );
+
+/* Requests queued whose callbacks have not run yet */
+int  fs_aio_inflight( struct fs_aio *aio );
+
+/* A descriptor that is readable while callbacks are waiting to run,
+   for event loops; fs_aio_poll drains it */
+int  fs_aio_fd( struct fs_aio *aio );
+
+#endif
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "qos.h"
+
+#define INVALID_CLIENT "Invalid client id"
+#define INVALID_LIMIT "Invalid QoS limit"
+
+typedef struct qos_request {
+	double tag;		/* virtual start time, smallest goes first */
+	int ready;		/* has the tokens it needs */
+	struct qos_request *next;
+} qos_request;
+
+typedef struct {
+	int weight;
+	double iops;
+	double bps;
+	double burst;		/* bucket depth in seconds of rate */
+	double op_tokens;
+	double byte_tokens;
+	double last_refill;
+	double finish;		/* virtual finish time of the last request */
+	qos_stats stats;
+} qos_client;
+
+struct qos {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int inflight;
+	double vclock;
+	qos_request *waiters;
+	qos_client clients[QOS_MAX_CLIENTS];
+};
+
+static __thread int current_client = 0;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct qos *qos_init()
+{
+	struct qos *qos = calloc(1, sizeof(struct qos));
+	pthread_condattr_t attr;
+	int i;
+
+	pthread_mutex_init(&qos->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&qos->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for(i = 0; i < QOS_MAX_CLIENTS; i++) {
+		qos->clients[i].weight = 1;
+	}
+	return qos;
+}
+
+void qos_close( struct qos *qos )
+{
+	pthread_cond_destroy(&qos->cond);
+	pthread_mutex_destroy(&qos->lock);
+	free(qos);
+}
+
+/* Binds the calling thread to client */
+int qos_set_client( int client )
+{
+	if(client < 0 || client >= QOS_MAX_CLIENTS) {
+		printf("%s\n", INVALID_CLIENT);
+		return -1;
+	}
+	current_client = client;
+	return 0;
+}
+
+int qos_get_client()
+{
+	return current_client;
+}
+
+int qos_set_limit( struct qos *qos, int client, int iops, int kbps, int burst_ms, int weight )
+{
+	qos_client *c;
+
+	if(client < 0 || client >= QOS_MAX_CLIENTS) {
+		printf("%s\n", INVALID_CLIENT);
+		return -1;
+	}
+	if(iops < 0 || kbps < 0 || burst_ms < 0 || weight < 1) {
+		printf("%s\n", INVALID_LIMIT);
+		return -1;
+	}
+
+	pthread_mutex_lock(&qos->lock);
+
+	c = &qos->clients[client];
+	c->iops = iops;
+	c->bps = kbps * 1024.0;
+	c->burst = burst_ms / 1000.0;
+	c->weight = weight;
+	c->op_tokens = c->iops * c->burst;
+	c->byte_tokens = c->bps * c->burst;
+	c->last_refill = now();
+
+	pthread_mutex_unlock(&qos->lock);
+	return 0;
+}
+
+static void refill( qos_client *c, double t )
+{
+	double elapsed = t - c->last_refill;
+	double depth;
+
+	c->last_refill = t;
+
+	depth = c->iops * c->burst;
+	if(depth < 1) depth = 1;
+	c->op_tokens += elapsed * c->iops;
+	if(c->op_tokens > depth) c->op_tokens = depth;
+
+	depth = c->bps * c->burst;
+	c->byte_tokens += elapsed * c->bps;
+	if(c->byte_tokens > depth) c->byte_tokens = depth;
+}
+
+/* Seconds until the client can issue a request of nbytes. A request
+   bigger than the bucket only needs a full bucket and leaves it in debt */
+static double token_wait( qos_client *c, int nbytes )
+{
+	double wait = 0, need, depth;
+
+	if(c->iops > 0 && c->op_tokens < 1) {
+		wait = (1 - c->op_tokens) / c->iops;
+	}
+
+	if(c->bps > 0) {
+		depth = c->bps * c->burst;
+		need = (nbytes < depth) ? nbytes : depth;
+		if(c->byte_tokens < need && (need - c->byte_tokens) / c->bps > wait) {
+			wait = (need - c->byte_tokens) / c->bps;
+		}
+	}
+
+	return wait;
+}
+
+/* Is req the ready request with the smallest virtual start time */
+static int is_next( struct qos *qos, qos_request *req )
+{
+	qos_request *r;
+	for(r = qos->waiters; r != NULL; r = r->next) {
+		if(r != req && r->ready && r->tag < req->tag) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void unlink_request( struct qos *qos, qos_request *req )
+{
+	qos_request **p = &qos->waiters;
+	while(*p != req) p = &(*p)->next;
+	*p = req->next;
+}
+
+/* Waits until the current client may use the disk for nbytes */
+void qos_begin( struct qos *qos, int nbytes )
+{
+	qos_client *c;
+	qos_request req;
+	double start, wait, t, throttled = 0;
+
+	pthread_mutex_lock(&qos->lock);
+
+	c = &qos->clients[current_client];
+	start = now();
+
+	req.tag = (qos->vclock > c->finish) ? qos->vclock : c->finish;
+	req.ready = 0;
+	req.next = qos->waiters;
+	qos->waiters = &req;
+	c->finish = req.tag + (double)nbytes / c->weight;
+
+	while(1) {
+		t = now();
+		refill(c, t);
+		wait = token_wait(c, nbytes);
+
+		if(wait > 0) {
+			struct timespec until;
+			double deadline = t + wait;
+
+			if(throttled == 0) {
+				c->stats.throttled++;
+			}
+			req.ready = 0;
+			until.tv_sec = (time_t)deadline;
+			until.tv_nsec = (long)((deadline - until.tv_sec) * 1e9);
+			pthread_cond_timedwait(&qos->cond, &qos->lock, &until);
+			throttled += now() - t;
+			continue;
+		}
+
+		req.ready = 1;
+		if(qos->inflight < QOS_QUEUE_DEPTH && is_next(qos, &req)) {
+			break;
+		}
+		pthread_cond_wait(&qos->cond, &qos->lock);
+	}
+
+	qos->inflight++;
+	qos->vclock = req.tag;
+	unlink_request(qos, &req);
+
+	c->op_tokens -= 1;
+	c->byte_tokens -= nbytes;
+	c->stats.ops++;
+	c->stats.bytes += nbytes;
+	c->stats.throttle_us += (long long)(throttled * 1e6);
+	c->stats.queue_us += (long long)((now() - start - throttled) * 1e6);
+
+	pthread_mutex_unlock(&qos->lock);
+}
+
+void qos_end( struct qos *qos )
+{
+	pthread_mutex_lock(&qos->lock);
+	qos->inflight--;
+	if(qos->waiters) {
+		pthread_cond_broadcast(&qos->cond);
+	}
+	pthread_mutex_unlock(&qos->lock);
+}
+
+int qos_get_stats( struct qos *qos, int client, qos_stats *stats )
+{
+	if(client < 0 || client >= QOS_MAX_CLIENTS) {
+		printf("%s\n", INVALID_CLIENT);
+		return -1;
+	}
+
+	pthread_mutex_lock(&qos->lock);
+	*stats = qos->clients[client].stats;
+	pthread_mutex_unlock(&qos->lock);
+	return 0;
+}
+
+void qos_print_stats( struct qos *qos )
+{
+	int i;
+
+	pthread_mutex_lock(&qos->lock);
+	printf("client  weight  iops  KiB/s  ops  bytes  throttled  throttle-ms  queue-ms\n");
+	for(i = 0; i < QOS_MAX_CLIENTS; i++) {
+		qos_client *c = &qos->clients[i];
+		if(c->stats.ops == 0 && c->iops == 0 && c->bps == 0) continue;
+		printf("%6d  %6d  %4.0f  %5.0f  %lld  %lld  %lld  %lld  %lld\n", i, c->weight,
+		       c->iops, c->bps / 1024, c->stats.ops, c->stats.bytes, c->stats.throttled,
+		       c->stats.throttle_us / 1000, c->stats.queue_us / 1000);
+	}
+	pthread_mutex_unlock(&qos->lock);
+}
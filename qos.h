@@ -0,0 +1,39 @@
+#ifndef QOS_H
+#define QOS_H
+
+/* Per-client I/O quality of service. Each client has token buckets for
+   IOPS and bandwidth and a weight on every disk; the disk is handed to
+   waiting requests in weighted fair-share order. */
+
+#define QOS_MAX_CLIENTS 64
+
+/* requests a disk serves at once, the rest queue in fair-share order */
+#define QOS_QUEUE_DEPTH 4
+
+struct qos;
+
+typedef struct {
+	long long ops;
+	long long bytes;
+	long long throttled;	/* requests that waited for tokens */
+	long long throttle_us;	/* time spent waiting for tokens */
+	long long queue_us;	/* time spent waiting for other clients */
+} qos_stats;
+
+struct qos *qos_init();
+void qos_close( struct qos *qos );
+
+/* The client of the calling thread, shared by all disks */
+int  qos_set_client( int client );
+int  qos_get_client();
+
+/* iops/kbps of 0 mean unlimited, burst_ms is the bucket depth */
+int  qos_set_limit( struct qos *qos, int client, int iops, int kbps, int burst_ms, int weight );
+
+void qos_begin( struct qos *qos, int nbytes );
+void qos_end( struct qos *qos );
+
+int  qos_get_stats( struct qos *qos, int client, qos_stats *stats );
+void qos_print_stats( struct qos *qos );
+
+#endif
@@ -1,13 +1,37 @@
 #include "fs.h"
 #include "disk.h"
+#include "cbt.h"
+#include "qos.h"
+#include "bufpool.h"
+#include "agroup.h"
+#include "fsaio.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 
-int do_copyin( char *filename, char * myfs_name);
-int do_copyout( char * myfs_name,  char *filename );
+/* I/O threads behind aiobench */
+#define AIO_BENCH_THREADS 8
+
+/* writebench files are named wb0 .. wb9999 */
+#define WRITEBENCH_MAX_THREADS 9999
+
+/* bytes moved per fs call by copyin/copyout */
+#define COPY_CHUNK 18432
+#define COPY_CHUNK_BLOCKS ((COPY_CHUNK + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE)
+
+int do_copyin( struct fs *fs, char *filename, char * myfs_name);
+int do_copyout( struct fs *fs, char * myfs_name,  char *filename );
+int load_key( struct disk *disk, char *keyfile );
+int do_bench( struct fs *fs, char *myfs_filename, int iosize, int mbytes );
+int parse_durability( const char *name );
+int do_syncbench( struct fs *fs, struct disk *disk, char *myfs_filename, int nops );
+int do_writebench( struct fs *fs, int nthreads, int iosize, int mbytes );
+int do_aiobench( struct fs *fs, char *myfs_filename, int depth, int nreads );
 
 int main( int argc, char *argv[] )
 {
@@ -15,19 +39,38 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
+	char arg3[1024];
+	char arg4[1024];
+	char arg5[1024];
 	int result, args;
+	int mounted = 0;
+	struct disk *disk;
+	struct fs *fs;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(argc!=3 && argc!=4) {
+		printf("use: %s <diskfile> <nblocks> [keyfile]\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	disk = disk_init(argv[1],atoi(argv[2]));
+	if(!disk) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	if(argc==4 && !load_key(disk,argv[3])) {
+		return 1;
+	}
+
+	fs = fs_init(disk);
+
+	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size(disk));
+	if(disk_cipher(disk)) {
+		printf("encryption: xts-aes-128 (%s)\n",disk_cipher(disk));
+	}
+	if(cbt_name(disk_cbt(disk))) {
+		printf("%d blocks changed since checkpoint %s\n",cbt_changed(disk_cbt(disk)),cbt_name(disk_cbt(disk)));
+	}
 
 	while(1) {
 		printf(" prompt> ");
@@ -38,12 +81,12 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		args = sscanf(line,"%s %s %s %s %s %s",cmd,arg1,arg2,arg3,arg4,arg5);
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
 			if(args==1) {
-				if(!fs_format()) {
+				if(!fs_format(fs)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
@@ -53,7 +96,8 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
-				if(!fs_mount()) {
+				if(!fs_mount(fs)) {
+					mounted = 1;
 					printf("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
@@ -63,13 +107,13 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
-				fs_debug();
+				fs_debug(fs);
 			} else {
 				printf("use: debug\n");
 			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
-				result = fs_getsize(arg1);
+				result = fs_getsize(fs,arg1);
 				if(result>=0) {
 					printf("file %s has size %d\n",arg1,result);
 				} else {
@@ -79,9 +123,29 @@ int main( int argc, char *argv[] )
 				printf("use: getsize <filename>\n");
 			}
 			
+		} else if(!strcmp(cmd,"truncate")) {
+			if(args==3) {
+				if(!fs_truncate(fs,arg1,atoi(arg2))) {
+					printf("file %s has size %d\n",arg1,atoi(arg2));
+				} else {
+					printf("truncate failed!\n");
+				}
+			} else {
+				printf("use: truncate <filename> <bytes>\n");
+			}
+		} else if(!strcmp(cmd,"fallocate")) {
+			if(args==3) {
+				if(!fs_fallocate(fs,arg1,atoi(arg2))) {
+					printf("reserved %d bytes for %s\n",atoi(arg2),arg1);
+				} else {
+					printf("fallocate failed!\n");
+				}
+			} else {
+				printf("use: fallocate <filename> <bytes>\n");
+			}
 		} else if(!strcmp(cmd,"create")) {
 			if(args==2) {
-				result = fs_create(arg1);
+				result = fs_create(fs,arg1);
 				if(result==0) {
 					printf("created file %s\n",arg1);
 				} else {
@@ -92,7 +156,7 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd,"delete")) {
 			if(args==2) {
-				if(!fs_delete(arg1)) {
+				if(!fs_delete(fs,arg1)) {
 					printf("file %s deleted.\n",arg1);
 				} else {
 					printf("delete failed!\n");	
@@ -102,7 +166,7 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
-				if(!do_copyout(arg1,"/dev/stdout")) {
+				if(!do_copyout(fs,arg1,"/dev/stdout")) {
 					printf("cat failed!\n");
 				}
 			} else {
@@ -111,7 +175,7 @@ int main( int argc, char *argv[] )
 
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
-				if(do_copyin(arg1,arg2)) {
+				if(do_copyin(fs,arg1,arg2)) {
 					printf("copied file %s to  %s\n",arg1,arg2);
 				} else {
 					printf("copy failed!\n");
@@ -122,7 +186,7 @@ int main( int argc, char *argv[] )
 
 		} else if(!strcmp(cmd,"copyout")) {
 			if(args==3) {
-				if(do_copyout(arg1,arg2)) {
+				if(do_copyout(fs,arg1,arg2)) {
 					printf("copied myfs_file %s to file %s\n", arg1,arg2);
 				} else {
 					printf("copy failed!\n");
@@ -131,6 +195,164 @@ int main( int argc, char *argv[] )
 				printf("use: copyout <inumber> <filename>\n");
 			}
 
+		} else if(!strcmp(cmd,"checkpoint")) {
+			if(args==2) {
+				if(!cbt_checkpoint(disk_cbt(disk),arg1)) {
+					printf("tracking changed blocks since checkpoint %s\n",arg1);
+				} else {
+					printf("checkpoint failed!\n");
+				}
+			} else {
+				printf("use: checkpoint <name>\n");
+			}
+
+		} else if(!strcmp(cmd,"export")) {
+			if(args==2 || args==3) {
+				char base[CBT_NAME_LEN+1] = "";
+				/* buffered appends and pending metadata belong in the delta */
+				if(mounted) fs_sync(fs);
+				if(cbt_name(disk_cbt(disk))) strcpy(base,cbt_name(disk_cbt(disk)));
+				result = cbt_export(disk,arg1,(args==3) ? arg2 : NULL);
+				if(result>=0) {
+					printf("exported %d blocks changed since checkpoint %s to %s\n",result,base,arg1);
+					if(args==3) printf("tracking changed blocks since checkpoint %s\n",arg2);
+				} else {
+					printf("export failed!\n");
+				}
+			} else {
+				printf("use: export <delta file> [next checkpoint]\n");
+			}
+
+		} else if(!strcmp(cmd,"apply")) {
+			if(args==2 && mounted) {
+				/* the filesystem's caches would overwrite the blocks */
+				printf("cannot apply a delta to a mounted disk, apply it before mounting\n");
+			} else if(args==2) {
+				result = cbt_apply(disk,arg1);
+				if(result>=0) {
+					printf("applied %d blocks from %s, disk at checkpoint %s\n",result,arg1,cbt_name(disk_cbt(disk)));
+				} else {
+					printf("apply failed!\n");
+				}
+			} else {
+				printf("use: apply <delta file>\n");
+			}
+
+		} else if(!strcmp(cmd,"client")) {
+			if(args==2) {
+				if(!fs_set_client(atoi(arg1))) {
+					printf("now issuing I/O as client %s\n",arg1);
+				}
+			} else {
+				printf("use: client <id>\n");
+			}
+
+		} else if(!strcmp(cmd,"qos")) {
+			if(args==6) {
+				if(!qos_set_limit(disk_qos(disk),atoi(arg1),atoi(arg2),atoi(arg3),atoi(arg4),atoi(arg5))) {
+					printf("client %s limited\n",arg1);
+				} else {
+					printf("qos failed!\n");
+				}
+			} else {
+				printf("use: qos <client> <iops> <KiB/s> <burst ms> <weight>\n");
+			}
+
+		} else if(!strcmp(cmd,"qosstat")) {
+			qos_print_stats(disk_qos(disk));
+
+		} else if(!strcmp(cmd,"poolstat")) {
+			bufpool_stats stats;
+			bufpool_get_stats(&stats);
+			printf("%lld buffers handed out, %lld from free lists, %lld newly carved\n",stats.gets,stats.cache_hits,stats.carved);
+			printf("%lld arenas (%lld on explicit huge pages), %lld large allocations\n",stats.arenas,stats.huge_arenas,stats.large);
+
+		} else if(!strcmp(cmd,"bench")) {
+			if(args==4 && atoi(arg2)>0 && atoi(arg3)>0) {
+				if(!do_bench(fs,arg1,atoi(arg2),atoi(arg3))) {
+					printf("bench failed!\n");
+				}
+			} else {
+				printf("use: bench <filename> <bytes per write> <MiB>\n");
+			}
+
+		} else if(!strcmp(cmd,"durability")) {
+			if((args==2 || args==3) && parse_durability(arg1)>=0) {
+				if(!fs_set_durability(fs,parse_durability(arg1),args==3 ? atoi(arg2) : 0)) {
+					printf("durability is now %s\n",arg1);
+				}
+			} else {
+				printf("use: durability <none|op|periodic|barrier> [interval ms]\n");
+			}
+
+		} else if(!strcmp(cmd,"sync")) {
+			if(!fs_sync(fs)) {
+				printf("synced\n");
+			} else {
+				printf("sync failed!\n");
+			}
+
+		} else if(!strcmp(cmd,"syncbench")) {
+			if(args==3 && atoi(arg2)>0) {
+				if(!do_syncbench(fs,disk,arg1,atoi(arg2))) {
+					printf("syncbench failed!\n");
+				}
+			} else {
+				printf("use: syncbench <filename> <writes>\n");
+			}
+
+		} else if(!strcmp(cmd,"writebench")) {
+			if(args==4 && atoi(arg1)>0 && atoi(arg2)>0 && atoi(arg3)>0) {
+				if(!do_writebench(fs,atoi(arg1),atoi(arg2),atoi(arg3))) {
+					printf("writebench failed!\n");
+				}
+			} else {
+				printf("use: writebench <threads> <bytes per write> <MiB per thread>\n");
+			}
+
+		} else if(!strcmp(cmd,"aiobench")) {
+			if(args==4 && atoi(arg2)>0 && atoi(arg3)>0) {
+				if(!do_aiobench(fs,arg1,atoi(arg2),atoi(arg3))) {
+					printf("aiobench failed!\n");
+				}
+			} else {
+				printf("use: aiobench <filename> <requests queued> <reads>\n");
+			}
+
+		} else if(!strcmp(cmd,"defrag")) {
+			if(args==1) {
+				fs_defrag_stats stats;
+				fs_defrag_get_stats(fs,&stats);
+				printf("defrag %s: %d files scanned, %d fragmented, %d moved, %d skipped, %lld blocks copied\n",
+					stats.running ? "running" : "idle",stats.files_scanned,stats.files_fragmented,
+					stats.files_moved,stats.files_skipped,stats.blocks_copied);
+				if(stats.files_moved) {
+					printf("moved files went from %lld to %lld extents\n",stats.extents_before,stats.extents_after);
+				}
+			} else if(args==2 && !strcmp(arg1,"stop")) {
+				fs_defrag_stop(fs);
+				printf("defrag stopped\n");
+			} else if(args==2 && atoi(arg1)>=0) {
+				if(!fs_defrag_start(fs,atoi(arg1))) {
+					printf("defrag started\n");
+				}
+			} else {
+				printf("use: defrag [<KiB/s, 0 for no limit>|stop]\n");
+			}
+
+		} else if(!strcmp(cmd,"fsck")) {
+			if(args==1 || (args==2 && !strcmp(arg1,"repair"))) {
+				fs_check_report report;
+				result = fs_check(fs,args==2,&report);
+				if(result>=0) {
+					printf("fsck: %d files, %d problems%s\n",report.files,result,report.repaired ? ", repaired" : "");
+				} else {
+					printf("fsck failed!\n");
+				}
+			} else {
+				printf("use: fsck [repair]\n");
+			}
+
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
 			printf("    format\n");
@@ -140,9 +362,26 @@ int main( int argc, char *argv[] )
 			printf("    delete  <filename>\n");
 			printf("    cat     <filename>\n");
 			printf("    getsize <filename>\n");
+			printf("    truncate  <filename> <bytes>\n");
+			printf("    fallocate <filename> <bytes>\n");
 			printf("    copyin  <file name in host system> <miei02-filename>\n");
 			printf("    copyout <miei02-filename> <file name in host system>\n");
 			printf("	dump <number_of_block_with_text_contents>\n");
+			printf("    checkpoint <name>\n");
+			printf("    export  <delta file> [next checkpoint]\n");
+			printf("    apply   <delta file>\n");
+			printf("    client  <id>\n");
+			printf("    qos     <client> <iops> <KiB/s> <burst ms> <weight>\n");
+			printf("    qosstat\n");
+			printf("    poolstat\n");
+			printf("    bench   <filename> <bytes per write> <MiB>\n");
+			printf("    durability <none|op|periodic|barrier> [interval ms]\n");
+			printf("    sync\n");
+			printf("    syncbench <filename> <writes>\n");
+			printf("    writebench <threads> <bytes per write> <MiB per thread>\n");
+			printf("    aiobench <filename> <requests queued> <reads>\n");
+			printf("    defrag  [<KiB/s, 0 for no limit>|stop]\n");
+			printf("    fsck    [repair]\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -154,11 +393,12 @@ int main( int argc, char *argv[] )
 			if(args==2) {
 				int blNo = atoi(arg1);
 				printf("Dumping disk block %d\n", blNo);
-				char b[4096];
-				disk_read( blNo, b);
+				char *b = bufpool_get(1);
+				disk_read(disk, blNo, b);
 				printf("------------------------------\n");
-				printf("%s", b);
+				printf("%.*s", DISK_BLOCK_SIZE, b);
 				printf("\n------------------------------\n");
+				bufpool_put(b, 1);
 			}
 			else {
 				printf("use: dump <block_number>\n");
@@ -171,16 +411,41 @@ int main( int argc, char *argv[] )
 	}
 
 	printf("closing emulated disk.\n");
-	disk_close();
+	fs_destroy(fs);
+	disk_close(disk);
 
 	return 0;
 }
 
-int do_copyin( char *filename, char *myfs_filename )
+int load_key( struct disk *disk, char *keyfile )
+{
+	FILE *file;
+	unsigned char key[DISK_KEY_SIZE];
+	int result;
+
+	file = fopen(keyfile,"r");
+	if(!file) {
+		printf("couldn't open %s: %s\n",keyfile,strerror(errno));
+		return 0;
+	}
+
+	result = fread(key,1,sizeof(key),file);
+	fclose(file);
+	if(result!=sizeof(key)) {
+		printf("key file %s must hold %d bytes\n",keyfile,DISK_KEY_SIZE);
+		return 0;
+	}
+
+	disk_set_key(disk,key);
+	memset(key,0,sizeof(key));
+	return 1;
+}
+
+int do_copyin( struct fs *fs, char *filename, char *myfs_filename )
 {
 	FILE *file;
-	int offset=0, result, actual;
-	char buffer[18432];
+	int offset=0, result, actual, fd;
+	char *buffer;
 
 	file = fopen(filename,"r");
 	if(!file) {
@@ -188,49 +453,77 @@ int do_copyin( char *filename, char *myfs_filename )
 		return 0;
 	}
 
+	fd = fs_open(fs,myfs_filename);
+	if(fd<0) {
+		fclose(file);
+		return 0;
+	}
+
+	/* the size is known, reserve it in one piece up front */
+	if(fseek(file,0,SEEK_END)==0) {
+		long size = ftell(file);
+		if(size>0 && size<=INT_MAX) {
+			fs_fallocate(fs,myfs_filename,size);
+		}
+		rewind(file);
+	}
+
+	buffer = bufpool_get(COPY_CHUNK_BLOCKS);
 	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
+		result = fread(buffer,1,COPY_CHUNK,file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(myfs_filename,buffer,result,offset);
+			actual = fs_fwrite(fs,fd,buffer,result);
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				printf("ERROR: fs_fwrite return invalid result %d\n",actual);
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				printf("WARNING: fs_fwrite only wrote %d bytes, not %d bytes\n",actual,result);
 				break;
 			}
 		}
 	}
 
+	bufpool_put(buffer,COPY_CHUNK_BLOCKS);
+	if(fs_close(fs,fd)<0) {
+		printf("WARNING: fs_close could not write all buffered data\n");
+	}
 	printf("%d bytes copied\n",offset);
 
 	fclose(file);
 	return 1;
 }
 
-int do_copyout( char *myfs_filename, char *filename )
+int do_copyout( struct fs *fs, char *myfs_filename, char *filename )
 {
 	FILE *file;
-	int offset=0, result;
-	char buffer[18432];
+	int offset=0, result, fd;
+	char *buffer;
+
+	fd = fs_open(fs,myfs_filename);
+	if(fd<0) return 0;
+
     if(strcmp(filename,"/dev/stdout"))
 		file = fopen(filename,"w");
 	else
 		file = stdout;
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(fs,fd);
 		return 0;
 	}
 
+	buffer = bufpool_get(COPY_CHUNK_BLOCKS);
 	while(1) {
-		result = fs_read(myfs_filename,buffer,sizeof(buffer),offset);
+		result = fs_fread(fs,fd,buffer,COPY_CHUNK);
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
 	}
+	bufpool_put(buffer,COPY_CHUNK_BLOCKS);
+	fs_close(fs,fd);
 
 	printf("%d bytes copied\n",offset);
 
@@ -239,3 +532,281 @@ int do_copyout( char *myfs_filename, char *filename )
 	return 1;
 }
 
+/* Times writes of iosize bytes over mbytes MiB of a file, first block
+   aligned and then shifted off the block boundary */
+int do_bench( struct fs *fs, char *myfs_filename, int iosize, int mbytes )
+{
+	long total = (long)mbytes<<20;
+	int fd, pass;
+	char *buffer;
+
+	fd = fs_open(fs,myfs_filename);
+	if(fd<0) return 0;
+
+	buffer = malloc(iosize);
+	memset(buffer,'b',iosize);
+	for(pass=0;pass<2;pass++) {
+		int shift = pass ? 512 : 0;
+		long offset, written=0;
+		struct timespec start, end;
+		double seconds;
+
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for(offset=0;offset+iosize<=total;offset+=iosize) {
+			int result = fs_pwrite(fs,fd,buffer,iosize,offset+shift);
+			if(result!=iosize) break;
+			written += result;
+		}
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		seconds = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+		printf("%s: %ld bytes in %d-byte writes, %.1f MB/s\n",pass ? "unaligned" : "aligned",written,iosize,written/seconds/1e6);
+	}
+	free(buffer);
+
+	fs_close(fs,fd);
+	return 1;
+}
+
+static const char *durability_names[] = { "none", "op", "periodic", "barrier" };
+
+int parse_durability( const char *name )
+{
+	int mode;
+	for(mode=FS_DURABLE_NONE;mode<=FS_DURABLE_BARRIER;mode++) {
+		if(!strcmp(name,durability_names[mode])) return mode;
+	}
+	return -1;
+}
+
+static int by_latency( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Appends nops blocks to a file by name under each durability mode,
+   a barrier every 64 writes in barrier mode, and reports throughput,
+   write latency and the fdatasync calls made. Leaves durability at
+   barrier, the default */
+int do_syncbench( struct fs *fs, struct disk *disk, char *myfs_filename, int nops )
+{
+	char *buffer = malloc(DISK_BLOCK_SIZE);
+	double *latency = malloc(nops*sizeof(double));
+	int mode, i;
+
+	memset(buffer,'s',DISK_BLOCK_SIZE);
+	for(mode=FS_DURABLE_NONE;mode<=FS_DURABLE_BARRIER;mode++) {
+		struct timespec start, end, t0, t1;
+		double seconds, sum = 0;
+		int syncs;
+
+		fs_delete(fs,myfs_filename);
+		if(fs_create(fs,myfs_filename)<0 || fs_set_durability(fs,mode,0)<0) {
+			free(buffer);
+			free(latency);
+			return 0;
+		}
+		syncs = disk_syncs(disk);
+
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for(i=0;i<nops;i++) {
+			clock_gettime(CLOCK_MONOTONIC,&t0);
+			if(fs_write(fs,myfs_filename,buffer,DISK_BLOCK_SIZE,i*DISK_BLOCK_SIZE)!=DISK_BLOCK_SIZE) break;
+			if(mode==FS_DURABLE_BARRIER && i%64==63) fs_sync(fs);
+			clock_gettime(CLOCK_MONOTONIC,&t1);
+			latency[i] = (t1.tv_sec-t0.tv_sec)*1e6 + (t1.tv_nsec-t0.tv_nsec)/1e3;
+			sum += latency[i];
+		}
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		if(i<nops) {
+			printf("%s: disk full after %d writes\n",durability_names[mode],i);
+			break;
+		}
+
+		seconds = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+		qsort(latency,nops,sizeof(double),by_latency);
+		printf("%-8s %8.0f writes/s, latency avg %.1f us, p99 %.1f us, max %.1f us, %d fdatasyncs\n",
+			durability_names[mode],nops/seconds,sum/nops,latency[nops*99/100],latency[nops-1],disk_syncs(disk)-syncs);
+	}
+
+	fs_set_durability(fs,FS_DURABLE_BARRIER,0);
+	fs_delete(fs,myfs_filename);
+	free(buffer);
+	free(latency);
+	return 1;
+}
+
+typedef struct {
+	struct fs *fs;
+	char name[16];
+	int iosize;
+	long bytes;
+	long written;
+} bench_writer;
+
+static void *write_worker( void *arg )
+{
+	bench_writer *w = arg;
+	char *buffer = malloc(w->iosize);
+	long offset;
+
+	memset(buffer,'w',w->iosize);
+	for(offset=0;offset+w->iosize<=w->bytes;offset+=w->iosize) {
+		if(fs_write(w->fs,w->name,buffer,w->iosize,offset)!=w->iosize) break;
+		w->written += w->iosize;
+	}
+	free(buffer);
+	return NULL;
+}
+
+/* Has 1, 2, 4 .. nthreads threads append mbytes MiB each to files of
+   their own in iosize writes, and reports the total throughput and how
+   the allocation groups served the threads */
+int do_writebench( struct fs *fs, int nthreads, int iosize, int mbytes )
+{
+	pthread_t *threads;
+	bench_writer *writers;
+	int n, i, ok = 1;
+
+	if(nthreads>WRITEBENCH_MAX_THREADS) {
+		printf("at most %d threads\n",WRITEBENCH_MAX_THREADS);
+		return 0;
+	}
+	threads = malloc(nthreads*sizeof(pthread_t));
+	writers = calloc(nthreads,sizeof(bench_writer));
+
+	if(!fs_agroups(fs)) {
+		printf("disk not mounted\n");
+		ok = 0;
+	}
+	for(n=1;ok;n*=2) {
+		struct timespec start, end;
+		agroups_stats before, after;
+		double seconds;
+		long written = 0;
+
+		if(n>nthreads) n = nthreads;
+		for(i=0;i<n;i++) {
+			writers[i].fs = fs;
+			snprintf(writers[i].name,sizeof writers[i].name,"wb%d",i);
+			writers[i].iosize = iosize;
+			writers[i].bytes = (long)mbytes<<20;
+			writers[i].written = 0;
+			fs_delete(fs,writers[i].name);
+			if(fs_create(fs,writers[i].name)<0) ok = 0;
+		}
+		if(!ok) break;
+
+		agroups_get_stats(fs_agroups(fs),&before);
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for(i=0;i<n;i++) pthread_create(&threads[i],NULL,write_worker,&writers[i]);
+		for(i=0;i<n;i++) pthread_join(threads[i],NULL);
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		agroups_get_stats(fs_agroups(fs),&after);
+
+		for(i=0;i<n;i++) written += writers[i].written;
+		seconds = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+		after.allocs -= before.allocs;
+		printf("%3d threads %8.1f MB/s, %lld allocations, %.0f%% from home groups, %lld stolen, %lld waits for a group\n",
+			n,written/seconds/1e6,after.allocs,after.allocs ? 100.0*(after.home-before.home)/after.allocs : 0,
+			after.steals-before.steals,after.waits-before.waits);
+		if(written<n*((long)mbytes<<20)) {
+			printf("disk full after %ld bytes\n",written);
+			ok = 0;
+		}
+
+		for(i=0;i<n;i++) fs_delete(fs,writers[i].name);
+		if(n==nthreads) break;
+	}
+
+	free(threads);
+	free(writers);
+	return ok;
+}
+
+typedef struct {
+	struct fs_aio *aio;
+	int fd;
+	int nblocks;
+	int total;
+	int submitted;
+	int failed;
+} aio_bench;
+
+typedef struct {
+	aio_bench *bench;
+	char *buffer;
+} aio_bench_slot;
+
+static void bench_read_done( int result, void *arg );
+
+static void bench_submit( aio_bench_slot *slot )
+{
+	aio_bench *b = slot->bench;
+	b->submitted++;
+	fs_aio_pread(b->aio,b->fd,slot->buffer,DISK_BLOCK_SIZE,(rand()%b->nblocks)*DISK_BLOCK_SIZE,bench_read_done,slot);
+}
+
+/* Runs in the thread that polls, which keeps the slot busy */
+static void bench_read_done( int result, void *arg )
+{
+	aio_bench_slot *slot = arg;
+	if(result!=DISK_BLOCK_SIZE) slot->bench->failed++;
+	if(slot->bench->submitted<slot->bench->total) bench_submit(slot);
+}
+
+/* Times nreads random block reads of a file through a descriptor, one
+   at a time and then from this thread alone with depth of them queued
+   to the fsaio thread pool, which reads at most AIO_BENCH_THREADS at a
+   time */
+int do_aiobench( struct fs *fs, char *myfs_filename, int depth, int nreads )
+{
+	aio_bench b;
+	aio_bench_slot *slots;
+	struct timespec start, end;
+	double seconds;
+	char *buffer;
+	int i, size;
+
+	size = fs_getsize(fs,myfs_filename);
+	if(size<DISK_BLOCK_SIZE) {
+		printf("%s needs at least a block of data\n",myfs_filename);
+		return 0;
+	}
+
+	memset(&b,0,sizeof(b));
+	b.fd = fs_open(fs,myfs_filename);
+	if(b.fd<0) return 0;
+	b.nblocks = size/DISK_BLOCK_SIZE;
+	b.total = nreads;
+
+	buffer = bufpool_get(1);
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for(i=0;i<nreads;i++) {
+		if(fs_pread(fs,b.fd,buffer,DISK_BLOCK_SIZE,(rand()%b.nblocks)*DISK_BLOCK_SIZE)!=DISK_BLOCK_SIZE) b.failed++;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	bufpool_put(buffer,1);
+	seconds = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+	printf("blocking: %8.0f reads/s\n",nreads/seconds);
+
+	b.aio = fs_aio_init(fs,AIO_BENCH_THREADS);
+	slots = malloc(depth*sizeof(aio_bench_slot));
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for(i=0;i<depth;i++) {
+		slots[i].bench = &b;
+		slots[i].buffer = bufpool_get(1);
+		if(b.submitted<nreads) bench_submit(&slots[i]);
+	}
+	while(fs_aio_inflight(b.aio)>0) fs_aio_wait(b.aio,1);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	fs_aio_destroy(b.aio);
+	seconds = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+	printf("pooled:   %8.0f reads/s, %d queued on %d I/O threads\n",nreads/seconds,depth,AIO_BENCH_THREADS);
+
+	for(i=0;i<depth;i++) bufpool_put(slots[i].buffer,1);
+	free(slots);
+	fs_close(fs,b.fd);
+	if(b.failed) printf("%d reads failed\n",b.failed);
+	return !b.failed;
+}
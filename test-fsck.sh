@@ -0,0 +1,74 @@
+#!/bin/sh
+# Corrupts a small image by hand and checks what fsck and fsck repair
+# make of it: a cross-link, a cycle and a leaked block. Run by make check.
+
+SHELL_BIN=${1:-./fs-shell}
+NBLOCKS=256
+DIR=$(mktemp -d)
+IMG=$DIR/img
+trap 'rm -rf "$DIR"' EXIT
+
+fail() {
+	echo "test-fsck: $*"
+	exit 1
+}
+
+run() {
+	printf "$2quit\n" | "$SHELL_BIN" "$1" $NBLOCKS
+}
+
+# the blocks of file $2 as the unmounted debug command lists them
+blocks_of() {
+	run "$1" "debug\n" | awk -v f="File \"$2\":" '
+		$0 == f { found = 1; next }
+		found && /^blocks:/ { sub(/^blocks: */, ""); sub(/ *$/, ""); print; exit }'
+}
+
+# sets the fat entry of block $2 to $3; the fat starts at block 2
+set_fat() {
+	v=$3
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $((v & 255)) $((v >> 8 & 255)) $((v >> 16 & 255)) $((v >> 24 & 255)))" |
+		dd of="$1" bs=1 seek=$((2 * 4096 + $2 * 4)) conv=notrunc 2>/dev/null
+}
+
+head -c 12000 /dev/urandom > "$DIR/three"
+head -c 8000 /dev/urandom > "$DIR/two"
+run "$IMG" "format\nmount\ncreate a\ncopyin $DIR/three a\ncreate b\ncopyin $DIR/three b\ncreate c\ncopyin $DIR/two c\n" > /dev/null
+
+set -- $(blocks_of "$IMG" a)
+A_LAST=$3
+set -- $(blocks_of "$IMG" b)
+B_FIRST=$1; B_LAST=$3
+set -- $(blocks_of "$IMG" c)
+C_FIRST=$1; C_SECOND=$2
+[ -n "$A_LAST" ] && [ -n "$B_LAST" ] && [ -n "$C_SECOND" ] || fail "files not laid out as expected"
+LEAK=$((NBLOCKS - 10))
+
+run "$IMG" "fsck\n" | grep -q "3 files, 0 problems" || fail "fresh image not clean"
+
+# a runs on into the tail of c, b loops back to its start, one block
+# is in use by nothing
+set_fat "$IMG" "$A_LAST" "$C_SECOND"
+set_fat "$IMG" "$B_LAST" "$B_FIRST"
+set_fat "$IMG" "$LEAK" 1
+
+out=$(run "$IMG" "fsck\n")
+echo "$out" | grep -q "file \"c\": chain runs into block $C_SECOND" || fail "cross-link not found: $out"
+echo "$out" | grep -q "file \"b\": chain meets itself" || fail "cycle not found: $out"
+echo "$out" | grep -q "1 blocks in use by no file" || fail "leak not found: $out"
+echo "$out" | grep -q "file \"a\"" && fail "a, the lowest slot, should keep the shared block: $out"
+
+# repair is the same every time, whatever the checker threads do
+for i in 1 2 3 4 5; do
+	cp "$IMG" "$DIR/copy$i"
+	run "$DIR/copy$i" "fsck repair\n" | grep -q "repaired" || fail "repair $i did nothing"
+	[ $i -eq 1 ] || cmp -s "$DIR/copy1" "$DIR/copy$i" || fail "repair $i differs from the first"
+done
+
+run "$DIR/copy1" "fsck\n" | grep -q "3 files, 0 problems" || fail "repaired image not clean"
+[ "$(blocks_of "$DIR/copy1" a)" = "$(set -- $(blocks_of "$IMG" a); echo "$1 $2 $3") $C_SECOND" ] ||
+	fail "a lost the shared block"
+[ "$(blocks_of "$DIR/copy1" c)" = "$C_FIRST" ] || fail "c not cut before the shared block"
+[ "$(blocks_of "$DIR/copy1" b | wc -w)" -eq 3 ] || fail "b not cut where it loops"
+
+echo "test-fsck: ok"